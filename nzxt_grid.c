@@ -1,8 +1,28 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
 #include <asm/byteorder.h>
 #include <asm/unaligned.h>
 
@@ -45,6 +65,8 @@ struct status_report {
 	uint8_t unknown4[5];
 } __attribute__((__packed__));
 
+static_assert(sizeof(struct status_report) == 21);
+
 enum output_report_id {
 	OUTPUT_REPORT_ID_INIT_COMMAND = 0x1,
 	OUTPUT_REPORT_ID_CHANNEL_COMMAND = 0x2,
@@ -75,375 +97,4590 @@ struct set_fan_speed_report {
 	uint8_t padding[60];
 } __attribute__((__packed__));
 
+union output_report {
+	struct init_command_report init_command;
+	struct set_fan_speed_report set_fan_speed;
+};
+
+/*
+ * Every output report goes through a per-device queue, drained by
+ * output_work. Init commands go first, then fan speeds by priority.
+ * A fan speed queued for a channel replaces the one still pending for it,
+ * so the queue never holds more than one command per channel.
+ */
+enum output_priority {
+	OUTPUT_PRIORITY_HIGH, /* failsafe, resume */
+	OUTPUT_PRIORITY_NORMAL,
+	OUTPUT_PRIORITY_COUNT
+};
+
+static const enum init_command_id init_commands[] = {
+	INIT_COMMAND_ID_DETECT_FANS,
+	INIT_COMMAND_ID_SOMETHING_OTHER,
+	INIT_COMMAND_ID_SOMETHING_OTHER2,
+};
+
+#define OUTPUT_MAX_RETRIES 5
+#define OUTPUT_RETRY_BASE_MS 10
+#define OUTPUT_FLUSH_TIMEOUT_MS 1000
+#define OUTPUT_MAX_INTERVAL_MS 100
+
+/*
+ * Kept as received, converted to hwmon units only when read, as most
+ * reports are never read.
+ */
 struct channel_status {
-	enum fan_type fan_type;
+	__be16 rpm;
+	uint8_t in_volt;
+	uint8_t in_centivolt;
+	uint8_t curr_amp;
+	uint8_t curr_centiamp;
+	int8_t fan_type; /* enum fan_type */
+
+	/* Last commanded duty, written with both output_lock and lock held */
+	uint8_t pwm;
+	bool pwm_set;
+
+	unsigned int report_count;
+	unsigned long updated; /* jiffies of the last report */
+};
+
+static long channel_speed_rpm(const struct channel_status *status)
+{
+	return be16_to_cpu(status->rpm);
+}
+
+static long channel_in_millivolt(const struct channel_status *status)
+{
+	return status->in_volt * 1000L + status->in_centivolt * 10L;
+}
+
+static long channel_curr_milliamp(const struct channel_status *status)
+{
+	return status->curr_amp * 1000L + status->curr_centiamp * 10L;
+}
+
+static uint8_t pwm_to_percent(long pwm)
+{
+	if (pwm >= 255)
+		return 100;
+
+	if (pwm <= 0)
+		return 0;
+
+	return pwm * 100 / 255;
+}
+
+/*
+ * Optional smoothing of a channel's readings, exposed as fanN_average,
+ * inN_average and currN_average. The raw *_input values are unaffected.
+ */
+enum filter_type {
+	FILTER_NONE,
+	FILTER_EMA, /* exponential moving average, time constant tau_ms */
+	FILTER_MEDIAN, /* median of the last window reports */
+};
+
+static const char *const filter_names[] = {
+	[FILTER_NONE] = "none",
+	[FILTER_EMA] = "ema",
+	[FILTER_MEDIAN] = "median",
+};
+
+enum filter_metric {
+	FILTER_METRIC_RPM,
+	FILTER_METRIC_IN,
+	FILTER_METRIC_CURR,
+	FILTER_METRIC_COUNT
+};
+
+#define FILTER_MEDIAN_MAX 9
+#define FILTER_EMA_SHIFT 8
+
+/* Protected by lock, as it's updated from hid_raw_event() */
+struct channel_filter {
+	enum filter_type type;
+	unsigned int tau_ms;
+	unsigned int window;
+
+	ktime_t last_sample;
+	s64 ema[FILTER_METRIC_COUNT]; /* fixed point, FILTER_EMA_SHIFT */
+	u32 samples[FILTER_METRIC_COUNT][FILTER_MEDIAN_MAX];
+	unsigned int sample_count;
+	unsigned int next_sample;
+};
+
+static long channel_metric(const struct channel_status *status,
+			   enum filter_metric metric)
+{
+	switch (metric) {
+	case FILTER_METRIC_RPM:
+		return channel_speed_rpm(status);
+	case FILTER_METRIC_IN:
+		return channel_in_millivolt(status);
+	default:
+		return channel_curr_milliamp(status);
+	}
+}
+
+static void update_channel_filter(struct channel_filter *filter,
+				  const struct channel_status *status)
+{
+	ktime_t now = ktime_get();
+	s64 dt_ms = ktime_ms_delta(now, filter->last_sample);
+	int metric;
+
+	for (metric = 0; metric < FILTER_METRIC_COUNT; metric++) {
+		s64 value = channel_metric(status, metric);
+
+		if (filter->type == FILTER_MEDIAN) {
+			filter->samples[metric][filter->next_sample] = value;
+			continue;
+		}
+
+		value <<= FILTER_EMA_SHIFT;
+
+		if (!filter->sample_count || filter->tau_ms + dt_ms <= 0)
+			filter->ema[metric] = value;
+		else
+			filter->ema[metric] +=
+				div64_s64((value - filter->ema[metric]) * dt_ms,
+					  filter->tau_ms + dt_ms);
+	}
+
+	if (filter->type == FILTER_MEDIAN &&
+	    ++filter->next_sample >= filter->window)
+		filter->next_sample = 0;
+
+	if (filter->sample_count < filter->window)
+		filter->sample_count++;
+
+	filter->last_sample = now;
+}
+
+static long channel_average(const struct channel_filter *filter,
+			    const struct channel_status *status,
+			    enum filter_metric metric)
+{
+	u32 sorted[FILTER_MEDIAN_MAX];
+	int count = filter->sample_count;
+	int i, j;
+
+	if (!count)
+		return channel_metric(status, metric);
+
+	switch (filter->type) {
+	case FILTER_EMA:
+		return (filter->ema[metric] + (1 << (FILTER_EMA_SHIFT - 1))) >>
+		       FILTER_EMA_SHIFT;
+
+	case FILTER_MEDIAN:
+		for (i = 0; i < count; i++) {
+			u32 sample = filter->samples[metric][i];
+
+			for (j = i; j > 0 && sorted[j - 1] > sample; j--)
+				sorted[j] = sorted[j - 1];
+			sorted[j] = sample;
+		}
+		return sorted[count / 2];
+
+	default:
+		return channel_metric(status, metric);
+	}
+}
+
+#define RAMP_INTERVAL_MS 100
+#define IDLE_POLL_MS 1000
+
+/* Output side of a channel, protected by output_lock */
+struct channel_control {
+	long output; /* duty last sent to the device */
+	bool output_set;
+
+	enum output_priority priority;
+
+	unsigned int slew_rate; /* %/s, 0 = unlimited */
+	long spinup_pwm;
+	unsigned int spinup_ms;
+	bool spinup;
+	unsigned long spinup_until; /* jiffies */
+
+	/* Applied to group writes: pwm * group_scale / 100 + group_offset */
+	unsigned int group_scale;
+	long group_offset;
+
+	/* Duty cap from the current/power budget, see budget_allocate() */
+	long budget_limit;
+	int budget_priority; /* higher is served first */
+};
+
+/*
+ * Duty -> RPM/current curve of a channel, measured by stepping the duty
+ * from 0 to 100% and waiting for the RPM to settle at each step.
+ */
+#define CALIBRATION_STEPS 11
+#define CALIBRATION_POLL_MS 250
+#define CALIBRATION_MIN_SETTLE_MS 2000
+#define CALIBRATION_MAX_SETTLE_MS 15000
+#define CALIBRATION_STABLE_REPORTS 3
+#define CALIBRATION_RPM_TOLERANCE 30
+
+struct calibration_point {
+	long pwm;
 	long speed_rpm;
-	long in_millivolt;
 	long curr_milliamp;
 };
 
+/* Protected by output_lock */
+struct channel_calibration {
+	struct calibration_point curve[CALIBRATION_STEPS];
+	int curve_size;
+
+	/* The sweep in progress, replaces curve once complete */
+	bool running;
+	struct calibration_point sweep[CALIBRATION_STEPS];
+	int step;
+	bool step_reached; /* the output got to the step duty */
+	unsigned long step_start; /* jiffies, since step_reached changed */
+	unsigned int report_count;
+	long last_rpm;
+	int stable_reports;
+
+	long saved_pwm;
+	bool saved_pwm_set;
+};
+
+/*
+ * Set-and-confirm state of a channel, under lock. Writing pwmN_settle
+ * arms it, sending the requested speed (or its budget cap) sets sent, and
+ * the first report after that (or the RPM settling, with
+ * settle_tolerance_rpm) sets done.
+ */
+struct channel_settle {
+	bool armed;
+	bool done;
+	int error;
+	long pwm;
+	ktime_t requested;
+	ktime_t sent; /* 0 until the requested speed went out */
+	ktime_t settled;
+	long last_rpm;
+	bool have_rpm;
+};
+
+/*
+ * Long-window RPM and current statistics of a channel, by the duty sent
+ * to it in 10% steps, for spotting failing fans. Only reports taken once
+ * the duty has been steady for HEALTH_SETTLE_MS count.
+ */
+#define HEALTH_BUCKETS 11
+#define HEALTH_SETTLE_MS 5000
+#define HEALTH_WINDOW 65536
+#define HEALTH_LINE_MAX 128 /* of fan_health */
+
+/* Welford's algorithm, mean with 8 and m2 with 16 fractional bits */
+struct running_stats {
+	u32 count;
+	s64 mean;
+	u64 m2;
+};
+
+struct health_bucket {
+	struct running_stats rpm;
+	struct running_stats curr;
+};
+
+/* Under lock */
+struct channel_health {
+	uint8_t speed_percent; /* last sent to the device */
+	bool speed_known;
+	unsigned long speed_since; /* jiffies */
+	struct health_bucket bucket[HEALTH_BUCKETS];
+};
+
+#define MAX_GROUPS 4
+
+/* Virtual PWM fanned out to a set of channels, protected by output_lock */
+struct pwm_group {
+	unsigned long channels;
+	long pwm;
+	bool pwm_set;
+};
+
+/*
+ * Raw traffic capture, read from debugfs as a stream of records, each one
+ * a header followed by header.size bytes of the report as sent/received.
+ */
+enum capture_direction {
+	CAPTURE_DIRECTION_IN = 0,
+	CAPTURE_DIRECTION_OUT = 1,
+};
+
+struct capture_record_header {
+	__le64 timestamp_ns; /* ktime_get_ns() */
+	uint8_t direction; /* should be one of enum capture_direction */
+	uint8_t size;
+} __attribute__((__packed__));
+
+#define CAPTURE_FIFO_SIZE 16384
+#define CAPTURE_MAX_REPORT_SIZE 255
+#define INJECT_MAX_REPORT_SIZE 64
+
+/*
+ * Capture state is refcounted separately from drvdata: an open capture file
+ * can outlive the device, debugfs still calls ->release after removal.
+ */
+struct capture {
+	struct kref kref;
+	struct kfifo fifo;
+	spinlock_t lock;
+	struct mutex read_lock; /* kfifo allows one reader at a time */
+	wait_queue_head_t wait;
+	unsigned long busy;
+	bool active;
+	bool removed;
+	u32 dropped;
+};
+
+/*
+ * Per-model descriptor, selected by hid_device_id.driver_data. The
+ * *_config masks (HWMON_F_*, HWMON_PWM_*, ...) are the hwmon attributes
+ * each of the first channel_count channels has. channel_milliamp is the
+ * rated output of a channel, what budgeting assumes a fan of unknown draw
+ * can take.
+ */
+struct device_config {
+	int channel_count;
+	u32 fan_config;
+	u32 pwm_config;
+	u32 in_config;
+	u32 curr_config;
+	unsigned int channel_milliamp;
+};
+
 struct drvdata {
 	struct hid_device *hid;
 	struct device *hwmon;
+	const struct device_config *config;
+	struct list_head node; /* in devices, under devices_lock */
 	struct channel_status channel[MAX_CHANNELS];
+	struct channel_filter filter[MAX_CHANNELS];
+	struct channel_health health[MAX_CHANNELS];
 	rwlock_t lock;
+
+	/*
+	 * Taken from the first status report, under lock. decode_status is
+	 * NULL until then.
+	 */
+	u8 firmware_major;
+	u16 firmware_minor;
+	u8 firmware_patch;
+	void (*decode_status)(struct channel_status *status,
+			      const struct status_report *report);
+
+	/*
+	 * Readings are always stored, but changes are only announced to
+	 * pollers and netlink listeners once they move past these from the
+	 * last announced ones, in notified. 0 means any change counts.
+	 */
+	unsigned int deadband_rpm;
+	unsigned int deadband_millivolt;
+	unsigned int deadband_milliamp;
+	struct channel_status notified[MAX_CHANNELS];
+
+	/*
+	 * Channels that sent a status report since the last fan detection.
+	 * fans_detected is completed once all of them did.
+	 */
+	unsigned long reported_channels;
+	bool fans_ready;
+	struct completion fans_detected;
+	unsigned int ready_timeout_ms;
+
+	/* Set under lock by hid_remove(), to release sysfs waiters */
+	bool removing;
+
+	/*
+	 * Idle mode, off if idle_timeout_ms is 0: the input stream is closed
+	 * once nothing has read the readings for that long. stream_open is
+	 * under stream_lock. stream_waiters counts the sysfs callbacks
+	 * waiting for reports, which keep the stream open.
+	 */
+	struct mutex stream_lock;
+	bool stream_open;
+	unsigned long stream_access; /* jiffies */
+	atomic_t stream_waiters;
+	unsigned int idle_timeout_ms;
+	struct delayed_work idle_work;
+
+	/*
+	 * Allocated once at probe, separately from drvdata so that it is
+	 * suitable for DMA. Serialized by output_lock.
+	 */
+	union output_report *output_report;
+	struct mutex output_lock;
+
+	/* Output queue, under output_lock */
+	unsigned long pending_init; /* bit N is init_commands[N] */
+	unsigned long pending_speed[OUTPUT_PRIORITY_COUNT];
+	uint8_t pending_speed_percent[MAX_CHANNELS];
+	int next_channel;
+	unsigned int output_attempt;
+	unsigned long output_last_sent; /* jiffies */
+	struct delayed_work output_work;
+	wait_queue_head_t output_wait;
+
+	unsigned int output_interval_ms; /* up to OUTPUT_MAX_INTERVAL_MS */
+	unsigned int output_queue_depth;
+	unsigned int output_retries;
+	unsigned int output_failures;
+
+	struct channel_control control[MAX_CHANNELS];
+	struct delayed_work ramp_work;
+
+	/*
+	 * Limits on the total draw of all channels, 0 = unlimited.
+	 * budget_work reallocates them as new readings come in.
+	 */
+	unsigned int curr_budget_ma;
+	unsigned int power_budget_mw;
+	struct work_struct budget_work;
+
+	struct pwm_group group[MAX_GROUPS];
+
+	struct channel_calibration calibration[MAX_CHANNELS];
+	struct delayed_work calibration_work;
+
+	struct channel_settle settle[MAX_CHANNELS];
+	wait_queue_head_t settle_wait;
+	unsigned int settle_timeout_ms;
+	unsigned int settle_tolerance_rpm;
+
+	struct work_struct detect_fans_work;
+
+	/* Periodic fan detection, off if redetect_interval_ms is 0 */
+	struct delayed_work redetect_work;
+	unsigned int redetect_interval_ms;
+
+	/* Channels whose fan type changed, under lock */
+	unsigned long fan_type_changed;
+	struct work_struct fan_event_work;
+
+	/* Channels with readings not yet multicast over netlink, under lock */
+	unsigned long genl_changed;
+	struct work_struct genl_status_work;
+
+	/*
+	 * Heartbeat failsafe: unless heartbeat is written at least every
+	 * failsafe_timeout_ms, all channels are set to at least failsafe_pwm.
+	 */
+	struct delayed_work failsafe_work;
+	unsigned int failsafe_timeout_ms;
+	long failsafe_pwm;
+	bool failsafe_active;
+	unsigned int failsafe_count;
+
+	struct dentry *debugfs;
+	struct capture *capture;
+};
+
+static struct dentry *debugfs_root;
+
+/* All bound devices, for the aggregate interface */
+static LIST_HEAD(devices);
+static DEFINE_MUTEX(devices_lock);
+
+/* Bumped on every reading change past the deadbands, on any device */
+static atomic_t aggregate_seq = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(aggregate_wait);
+
+/*
+ * Generic netlink interface. Decoded readings are multicast on the
+ * "status" group, batched per device, fan type changes, failsafe state
+ * and sent speed commands on "events". NZXT_GRID_CMD_SET_PWM sets several
+ * channels at once, NZXT_GRID_CMD_GET_STATUS returns the readings of one
+ * device, or of all of them when dumped. Devices are named as hwmon
+ * devices, channels are numbered from 1 like hwmon attributes.
+ *
+ * This is the interface for tools that would otherwise parse the hwmon
+ * attributes of every device: one dump enumerates the devices and gives
+ * a consistent snapshot of each. Attribute numbers are ABI, new ones are
+ * only ever appended.
+ */
+#define NZXT_GRID_GENL_NAME "nzxt_grid"
+#define NZXT_GRID_GENL_VERSION 1
+
+enum nzxt_grid_cmd {
+	NZXT_GRID_CMD_UNSPEC,
+	NZXT_GRID_CMD_STATUS,
+	NZXT_GRID_CMD_FAN_TYPE,
+	NZXT_GRID_CMD_FAILSAFE,
+	NZXT_GRID_CMD_OUTPUT_DONE,
+	NZXT_GRID_CMD_SET_PWM,
+	NZXT_GRID_CMD_GET_STATUS,
+};
+
+enum nzxt_grid_attr {
+	NZXT_GRID_ATTR_UNSPEC,
+	NZXT_GRID_ATTR_DEVICE, /* string */
+	NZXT_GRID_ATTR_CHANNEL, /* nested, repeated */
+	NZXT_GRID_ATTR_FAILSAFE_ACTIVE, /* u8 */
+	__NZXT_GRID_ATTR_MAX,
+};
+
+#define NZXT_GRID_ATTR_MAX (__NZXT_GRID_ATTR_MAX - 1)
+
+enum nzxt_grid_channel_attr {
+	NZXT_GRID_CHANNEL_ATTR_UNSPEC,
+	NZXT_GRID_CHANNEL_ATTR_INDEX, /* u8 */
+	NZXT_GRID_CHANNEL_ATTR_FAN_TYPE, /* u8 */
+	NZXT_GRID_CHANNEL_ATTR_FAN_RPM, /* u32 */
+	NZXT_GRID_CHANNEL_ATTR_IN_MILLIVOLT, /* u32 */
+	NZXT_GRID_CHANNEL_ATTR_CURR_MILLIAMP, /* u32 */
+	NZXT_GRID_CHANNEL_ATTR_PWM, /* u8 */
+	NZXT_GRID_CHANNEL_ATTR_SPEED_PERCENT, /* u8 */
+	NZXT_GRID_CHANNEL_ATTR_ERROR, /* s32 */
+	__NZXT_GRID_CHANNEL_ATTR_MAX,
+};
+
+#define NZXT_GRID_CHANNEL_ATTR_MAX (__NZXT_GRID_CHANNEL_ATTR_MAX - 1)
+
+enum nzxt_grid_mcgrp {
+	NZXT_GRID_MCGRP_STATUS,
+	NZXT_GRID_MCGRP_EVENTS,
 };
 
+static struct genl_family genl_family;
+
+/* Worst case of one NZXT_GRID_ATTR_CHANNEL nest */
+static size_t genl_channel_size(void)
+{
+	return nla_total_size(0) + 4 * nla_total_size(sizeof(u8)) +
+	       4 * nla_total_size(sizeof(u32));
+}
+
+/*
+ * Returns NULL if nobody listens on the group. size is what the caller
+ * adds after the device name.
+ */
+static struct sk_buff *genl_msg_start(struct drvdata *drvdata, u8 cmd,
+				      unsigned int group, size_t size,
+				      void **hdr)
+{
+	struct sk_buff *skb;
+
+	/* Reports start coming in before probe registers hwmon */
+	if (IS_ERR_OR_NULL(drvdata->hwmon))
+		return NULL;
+
+	if (!genl_has_listeners(&genl_family, &init_net, group))
+		return NULL;
+
+	size += nla_total_size(strlen(dev_name(drvdata->hwmon)) + 1);
+	skb = genlmsg_new(size, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	*hdr = genlmsg_put(skb, 0, 0, &genl_family, 0, cmd);
+	if (!*hdr)
+		goto err_free;
+
+	if (nla_put_string(skb, NZXT_GRID_ATTR_DEVICE,
+			   dev_name(drvdata->hwmon)))
+		goto err_cancel;
+
+	return skb;
+
+err_cancel:
+	genlmsg_cancel(skb, *hdr);
+err_free:
+	nlmsg_free(skb);
+	return NULL;
+}
+
+static void genl_msg_send(struct sk_buff *skb, void *hdr, unsigned int group)
+{
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&genl_family, skb, 0, group, GFP_KERNEL);
+}
+
+static int genl_put_status(struct sk_buff *skb, int channel,
+			   const struct channel_status *channel_status)
+{
+	struct nlattr *nest = nla_nest_start(skb, NZXT_GRID_ATTR_CHANNEL);
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	/* Readings are left out for a channel without a fan */
+	if (nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_INDEX, channel + 1) ||
+	    nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_FAN_TYPE,
+		       channel_status->fan_type) ||
+	    (channel_status->fan_type != FAN_TYPE_NONE &&
+	     (nla_put_u32(skb, NZXT_GRID_CHANNEL_ATTR_FAN_RPM,
+			  channel_speed_rpm(channel_status)) ||
+	      nla_put_u32(skb, NZXT_GRID_CHANNEL_ATTR_IN_MILLIVOLT,
+			  channel_in_millivolt(channel_status)) ||
+	      nla_put_u32(skb, NZXT_GRID_CHANNEL_ATTR_CURR_MILLIAMP,
+			  channel_curr_milliamp(channel_status)))) ||
+	    (channel_status->pwm_set &&
+	     nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_PWM,
+			channel_status->pwm))) {
+		nla_nest_cancel(skb, nest);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(skb, nest);
+	return 0;
+}
+
+/* One message with every channel that changed since the last one */
+static void genl_status_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(work, struct drvdata, genl_status_work);
+	struct channel_status channel[MAX_CHANNELS];
+	unsigned long irq_flags;
+	unsigned long changed;
+	struct sk_buff *skb;
+	int index;
+	void *hdr;
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	memcpy(channel, drvdata->channel, sizeof(channel));
+	changed = drvdata->genl_changed;
+	drvdata->genl_changed = 0;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	skb = genl_msg_start(drvdata, NZXT_GRID_CMD_STATUS,
+			     NZXT_GRID_MCGRP_STATUS,
+			     hweight_long(changed) * genl_channel_size(), &hdr);
+	if (!skb)
+		return;
+
+	for_each_set_bit(index, &changed, MAX_CHANNELS) {
+		if (genl_put_status(skb, index, &channel[index]))
+			break;
+	}
+
+	genl_msg_send(skb, hdr, NZXT_GRID_MCGRP_STATUS);
+}
+
+static void genl_notify_fan_type(struct drvdata *drvdata,
+				 unsigned long changed)
+{
+	int8_t fan_type[MAX_CHANNELS];
+	unsigned long irq_flags;
+	struct nlattr *nest;
+	struct sk_buff *skb;
+	int channel;
+	void *hdr;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	for (channel = 0; channel < MAX_CHANNELS; channel++)
+		fan_type[channel] = drvdata->channel[channel].fan_type;
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	skb = genl_msg_start(drvdata, NZXT_GRID_CMD_FAN_TYPE,
+			     NZXT_GRID_MCGRP_EVENTS,
+			     hweight_long(changed) * genl_channel_size(), &hdr);
+	if (!skb)
+		return;
+
+	for_each_set_bit(channel, &changed, MAX_CHANNELS) {
+		nest = nla_nest_start(skb, NZXT_GRID_ATTR_CHANNEL);
+		if (!nest)
+			break;
+
+		if (nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_INDEX,
+			       channel + 1) ||
+		    nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_FAN_TYPE,
+			       fan_type[channel])) {
+			nla_nest_cancel(skb, nest);
+			break;
+		}
+
+		nla_nest_end(skb, nest);
+	}
+
+	genl_msg_send(skb, hdr, NZXT_GRID_MCGRP_EVENTS);
+}
+
+static void genl_notify_failsafe(struct drvdata *drvdata, bool active)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genl_msg_start(drvdata, NZXT_GRID_CMD_FAILSAFE,
+			     NZXT_GRID_MCGRP_EVENTS, nla_total_size(sizeof(u8)),
+			     &hdr);
+	if (!skb)
+		return;
+
+	if (nla_put_u8(skb, NZXT_GRID_ATTR_FAILSAFE_ACTIVE, active)) {
+		nlmsg_free(skb);
+		return;
+	}
+
+	genl_msg_send(skb, hdr, NZXT_GRID_MCGRP_EVENTS);
+}
+
+static void genl_notify_output_done(struct drvdata *drvdata, int channel,
+				    int error)
+{
+	struct nlattr *nest;
+	struct sk_buff *skb;
+	void *hdr;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	/* Sent for every output report, ramp steps included: keep it small */
+	skb = genl_msg_start(drvdata, NZXT_GRID_CMD_OUTPUT_DONE,
+			     NZXT_GRID_MCGRP_EVENTS, genl_channel_size(), &hdr);
+	if (!skb)
+		return;
+
+	nest = nla_nest_start(skb, NZXT_GRID_ATTR_CHANNEL);
+	if (!nest ||
+	    nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_INDEX, channel + 1) ||
+	    nla_put_u8(skb, NZXT_GRID_CHANNEL_ATTR_SPEED_PERCENT,
+		       drvdata->pending_speed_percent[channel]) ||
+	    nla_put_s32(skb, NZXT_GRID_CHANNEL_ATTR_ERROR, error)) {
+		nlmsg_free(skb);
+		return;
+	}
+
+	nla_nest_end(skb, nest);
+	genl_msg_send(skb, hdr, NZXT_GRID_MCGRP_EVENTS);
+}
+
+static void capture_report(struct drvdata *drvdata,
+			   enum capture_direction direction, const u8 *data,
+			   int size)
+{
+	struct capture *capture = drvdata->capture;
+	struct capture_record_header header;
+	unsigned long irq_flags;
+
+	if (!READ_ONCE(capture->active))
+		return;
+
+	header.timestamp_ns = cpu_to_le64(ktime_get_ns());
+	header.direction = direction;
+	header.size = clamp_val(size, 0, CAPTURE_MAX_REPORT_SIZE);
+
+	spin_lock_irqsave(&capture->lock, irq_flags);
+
+	if (!capture->active) {
+		spin_unlock_irqrestore(&capture->lock, irq_flags);
+		return;
+	}
+
+	if (kfifo_avail(&capture->fifo) >= sizeof(header) + header.size) {
+		kfifo_in(&capture->fifo, (u8 *)&header, sizeof(header));
+		kfifo_in(&capture->fifo, data, header.size);
+	} else {
+		capture->dropped++;
+	}
+
+	spin_unlock_irqrestore(&capture->lock, irq_flags);
+
+	wake_up_interruptible(&capture->wait);
+}
+
 static void update_channel_status(struct channel_status *status,
-				  struct status_report *report)
+				  const struct status_report *report)
 {
 	uint8_t fan_type = report->fan_type;
 	switch (fan_type) {
 	case FAN_TYPE_NONE:
 	case FAN_TYPE_DC:
 	case FAN_TYPE_PWM:
-		status->fan_type = (enum fan_type)fan_type;
+		status->fan_type = fan_type;
 		break;
 
 	default:
-		pr_warn("Invalid fan type %#x\n", fan_type);
+		pr_warn_ratelimited("Invalid fan type %#x\n", fan_type);
 		status->fan_type = FAN_TYPE_INVALID;
 	}
 
-	status->speed_rpm = get_unaligned_be16(&report->rpm);
-	status->in_millivolt =
-		report->in_volt * 1000L + report->in_centivolt * 10L;
-	status->curr_milliamp =
-		report->curr_amp * 1000L + report->curr_centiamp * 10L;
+	status->rpm = get_unaligned(&report->rpm);
+	status->in_volt = report->in_volt;
+	status->in_centivolt = report->in_centivolt;
+	status->curr_amp = report->curr_amp;
+	status->curr_centiamp = report->curr_centiamp;
+}
+
+#define FIRMWARE_VERSION(major, minor) ((u32)(major) << 16 | (minor))
+
+/* Status report layouts, by the lowest firmware version using them */
+static const struct status_decoder {
+	u32 min_version;
+	void (*decode)(struct channel_status *status,
+		       const struct status_report *report);
+} status_decoders[] = {
+	{ FIRMWARE_VERSION(0, 0), update_channel_status },
+};
+
+static void select_status_decoder(struct drvdata *drvdata,
+				  const struct status_report *report)
+{
+	u16 minor = get_unaligned_be16(&report->firmware_version_minor);
+	u32 version = FIRMWARE_VERSION(report->firmware_version_major, minor);
+	int i;
+
+	lockdep_assert_held_write(&drvdata->lock);
+
+	drvdata->firmware_major = report->firmware_version_major;
+	drvdata->firmware_minor = minor;
+	drvdata->firmware_patch = report->firmware_version_patch;
+
+	for (i = ARRAY_SIZE(status_decoders) - 1; i > 0; i--)
+		if (version >= status_decoders[i].min_version)
+			break;
+
+	drvdata->decode_status = status_decoders[i].decode;
 }
 
 static struct channel_status *get_channel_status(struct drvdata *drvdata,
 						 int channel_index)
 {
-	if (channel_index < 0 || channel_index >= MAX_CHANNELS) {
-		pr_warn("Invalid channel index %d\n", channel_index);
+	if (channel_index < 0 ||
+	    channel_index >= drvdata->config->channel_count) {
+		pr_warn_ratelimited("Invalid channel index %d\n",
+				    channel_index);
 		return NULL;
 	}
 
 	return &drvdata->channel[channel_index];
 }
 
-static void update_status(struct drvdata *drvdata, struct status_report *report)
+/* Called for every status report, with lock held for writing */
+static void settle_report(struct drvdata *drvdata, int channel,
+			  const struct channel_status *channel_status)
 {
-	struct channel_status *channel_status =
-		get_channel_status(drvdata, report->channel_index);
+	struct channel_settle *settle = &drvdata->settle[channel];
+	unsigned int tolerance = READ_ONCE(drvdata->settle_tolerance_rpm);
+	long rpm = channel_speed_rpm(channel_status);
 
-	if (channel_status) {
-		unsigned long irq_flags;
-		write_lock_irqsave(&drvdata->lock, irq_flags);
-		update_channel_status(channel_status, report);
-		write_unlock_irqrestore(&drvdata->lock, irq_flags);
+	lockdep_assert_held_write(&drvdata->lock);
+
+	if (!settle->armed || settle->done || !settle->sent)
+		return;
+
+	if (tolerance &&
+	    (!settle->have_rpm || abs(rpm - settle->last_rpm) > tolerance)) {
+		settle->last_rpm = rpm;
+		settle->have_rpm = true;
+		return;
 	}
+
+	settle->settled = ktime_get();
+	settle->done = true;
+	wake_up_all(&drvdata->settle_wait);
 }
 
-static int send_init_command(struct drvdata *drvdata,
-			     enum init_command_id command)
+/* Once count reaches HEALTH_WINDOW, older samples fade out by halves */
+static void running_stats_add(struct running_stats *stats, long value)
+{
+	s64 x = (s64)value << 8;
+	s64 delta;
+
+	if (stats->count == HEALTH_WINDOW) {
+		stats->count /= 2;
+		stats->m2 /= 2;
+	}
+
+	delta = x - stats->mean;
+	stats->count++;
+	stats->mean += div_s64(delta, stats->count);
+	stats->m2 += delta * (x - stats->mean);
+}
+
+static long running_stats_mean(const struct running_stats *stats)
+{
+	return stats->mean >> 8;
+}
+
+static u64 running_stats_variance(const struct running_stats *stats)
+{
+	if (stats->count < 2)
+		return 0;
+
+	return div64_u64(stats->m2, stats->count - 1) >> 16;
+}
+
+/* Called for every status report, with lock held for writing */
+static void health_report(struct drvdata *drvdata, int channel,
+			  const struct channel_status *channel_status)
+{
+	struct channel_health *health = &drvdata->health[channel];
+	unsigned long steady = health->speed_since +
+			       msecs_to_jiffies(HEALTH_SETTLE_MS);
+	struct health_bucket *bucket;
+
+	lockdep_assert_held_write(&drvdata->lock);
+
+	if (!health->speed_known || time_before(jiffies, steady))
+		return;
+
+	if (channel_status->fan_type != FAN_TYPE_DC &&
+	    channel_status->fan_type != FAN_TYPE_PWM)
+		return;
+
+	bucket = &health->bucket[health->speed_percent / 10];
+	running_stats_add(&bucket->rpm, channel_speed_rpm(channel_status));
+	running_stats_add(&bucket->curr,
+			  channel_curr_milliamp(channel_status));
+}
+
+static bool channel_status_changed(struct drvdata *drvdata,
+				   const struct channel_status *old,
+				   const struct channel_status *new)
+{
+	lockdep_assert_held(&drvdata->lock);
+
+	if (!old->report_count || old->fan_type != new->fan_type)
+		return true;
+
+	return abs(channel_speed_rpm(new) - channel_speed_rpm(old)) >
+		       READ_ONCE(drvdata->deadband_rpm) ||
+	       abs(channel_in_millivolt(new) - channel_in_millivolt(old)) >
+		       READ_ONCE(drvdata->deadband_millivolt) ||
+	       abs(channel_curr_milliamp(new) - channel_curr_milliamp(old)) >
+		       READ_ONCE(drvdata->deadband_milliamp);
+}
+
+static void update_status(struct drvdata *drvdata, struct status_report *report)
+{
+	struct channel_status *channel_status =
+		get_channel_status(drvdata, report->channel_index);
+	unsigned long all_channels =
+		GENMASK(drvdata->config->channel_count - 1, 0);
+	struct channel_status *notified;
+	enum fan_type old_fan_type;
+	unsigned long irq_flags;
+
+	if (!channel_status)
+		return;
+
+	notified = &drvdata->notified[report->channel_index];
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+
+	if (unlikely(!drvdata->decode_status))
+		select_status_decoder(drvdata, report);
+
+	old_fan_type = channel_status->fan_type;
+	drvdata->decode_status(channel_status, report);
+
+	if (drvdata->filter[report->channel_index].type != FILTER_NONE)
+		update_channel_filter(&drvdata->filter[report->channel_index],
+				      channel_status);
+
+	if (channel_status->report_count &&
+	    channel_status->fan_type != old_fan_type) {
+		__set_bit(report->channel_index, &drvdata->fan_type_changed);
+		schedule_work(&drvdata->fan_event_work);
+	}
+
+	channel_status->updated = jiffies;
+	channel_status->report_count++;
+
+	if (channel_status_changed(drvdata, notified, channel_status)) {
+		*notified = *channel_status;
+
+		atomic_inc(&aggregate_seq);
+		wake_up_interruptible(&aggregate_wait);
+
+		if (genl_has_listeners(&genl_family, &init_net,
+				       NZXT_GRID_MCGRP_STATUS)) {
+			__set_bit(report->channel_index,
+				  &drvdata->genl_changed);
+			schedule_work(&drvdata->genl_status_work);
+		}
+	}
+
+	settle_report(drvdata, report->channel_index, channel_status);
+	health_report(drvdata, report->channel_index, channel_status);
+
+	if (READ_ONCE(drvdata->curr_budget_ma) ||
+	    READ_ONCE(drvdata->power_budget_mw))
+		schedule_work(&drvdata->budget_work);
+
+	__set_bit(report->channel_index, &drvdata->reported_channels);
+	if (!drvdata->fans_ready &&
+	    (drvdata->reported_channels & all_channels) == all_channels) {
+		drvdata->fans_ready = true;
+		complete_all(&drvdata->fans_detected);
+	}
+
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+}
+
+static int send_output_report(struct drvdata *drvdata, size_t size)
+{
+	u8 *data = (u8 *)drvdata->output_report;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	capture_report(drvdata, CAPTURE_DIRECTION_OUT, data, size);
+	return hid_hw_output_report(drvdata->hid, data, size);
+}
+
+static bool output_retryable(int ret)
+{
+	return ret == -EPIPE || ret == -ETIMEDOUT || ret == -EAGAIN;
+}
+
+static void output_kick(struct drvdata *drvdata)
+{
+	unsigned long next = drvdata->output_last_sent +
+		msecs_to_jiffies(READ_ONCE(drvdata->output_interval_ms));
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	queue_delayed_work(system_wq, &drvdata->output_work,
+			   time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+/*
+ * Fills the output report with the next queued command, returns its size
+ * or 0 if the queue is empty. The command stays queued until sent.
+ */
+static size_t output_peek(struct drvdata *drvdata, unsigned long **pending,
+			  int *bit)
+{
+	union output_report *report = drvdata->output_report;
+	struct set_fan_speed_report *speed = &report->set_fan_speed;
+	int priority;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	if (drvdata->pending_init) {
+		*pending = &drvdata->pending_init;
+		*bit = __ffs(drvdata->pending_init);
+
+		report->init_command.report_id = OUTPUT_REPORT_ID_INIT_COMMAND;
+		report->init_command.command = init_commands[*bit];
+		return sizeof(report->init_command);
+	}
+
+	for (priority = 0; priority < OUTPUT_PRIORITY_COUNT; priority++) {
+		unsigned long *mask = &drvdata->pending_speed[priority];
+
+		if (!*mask)
+			continue;
+
+		/* Round robin, so a busy channel can't starve the others */
+		*pending = mask;
+		*bit = find_next_bit(mask, MAX_CHANNELS, drvdata->next_channel);
+		if (*bit >= MAX_CHANNELS)
+			*bit = __ffs(*mask);
+
+		memset(speed, 0, sizeof(*speed));
+		speed->report_id = OUTPUT_REPORT_ID_CHANNEL_COMMAND;
+		speed->command = CHANNEL_COMMAND_ID_SET_FAN_SPEED;
+		speed->channel_index = *bit;
+		speed->fan_speed_percent = drvdata->pending_speed_percent[*bit];
+		return sizeof(*speed);
+	}
+
+	return 0;
+}
+
+/*
+ * Called after a speed command for the channel was sent or dropped, for
+ * set-and-confirm and health tracking
+ */
+static void speed_sent(struct drvdata *drvdata, int channel, int error)
+{
+	struct channel_settle *settle = &drvdata->settle[channel];
+	struct channel_health *health = &drvdata->health[channel];
+	long budget_limit = drvdata->control[channel].budget_limit;
+	uint8_t speed_percent = drvdata->pending_speed_percent[channel];
+	unsigned long irq_flags;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+
+	if (error >= 0 &&
+	    (!health->speed_known || health->speed_percent != speed_percent)) {
+		health->speed_percent = speed_percent;
+		health->speed_known = true;
+		health->speed_since = jiffies;
+	}
+
+	if (settle->armed && !settle->done && !settle->sent) {
+		if (error < 0) {
+			settle->error = error;
+			settle->done = true;
+			wake_up_all(&drvdata->settle_wait);
+		} else if (speed_percent ==
+			   pwm_to_percent(min(settle->pwm, budget_limit))) {
+			settle->sent = ktime_get();
+		}
+	}
+
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+}
+
+static void output_dequeue(struct drvdata *drvdata, unsigned long *pending,
+			   int bit)
+{
+	lockdep_assert_held(&drvdata->output_lock);
+
+	__clear_bit(bit, pending);
+	WRITE_ONCE(drvdata->output_queue_depth,
+		   drvdata->output_queue_depth - 1);
+
+	if (pending != &drvdata->pending_init)
+		drvdata->next_channel = bit + 1;
+}
+
+static void output_work(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata, output_work);
+	unsigned long *pending;
+	size_t size;
+	int bit;
+	int ret;
+
+	mutex_lock(&drvdata->output_lock);
+
+	while ((size = output_peek(drvdata, &pending, &bit))) {
+		ret = send_output_report(drvdata, size);
+		drvdata->output_last_sent = jiffies;
+
+		if (ret < 0 && output_retryable(ret) &&
+		    drvdata->output_attempt < OUTPUT_MAX_RETRIES) {
+			unsigned int backoff = OUTPUT_RETRY_BASE_MS
+					       << drvdata->output_attempt;
+
+			drvdata->output_attempt++;
+			WRITE_ONCE(drvdata->output_retries,
+				   drvdata->output_retries + 1);
+			queue_delayed_work(system_wq, &drvdata->output_work,
+					   msecs_to_jiffies(backoff));
+			break;
+		}
+
+		if (ret < 0) {
+			pr_warn_ratelimited("Failed to send output report: %d\n",
+					    ret);
+			WRITE_ONCE(drvdata->output_failures,
+				   drvdata->output_failures + 1);
+		}
+
+		drvdata->output_attempt = 0;
+		output_dequeue(drvdata, pending, bit);
+
+		if (pending != &drvdata->pending_init) {
+			speed_sent(drvdata, bit, ret);
+			genl_notify_output_done(drvdata, bit, min(ret, 0));
+		}
+
+		if (READ_ONCE(drvdata->output_interval_ms)) {
+			if (drvdata->output_queue_depth)
+				output_kick(drvdata);
+			break;
+		}
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+
+	if (!READ_ONCE(drvdata->output_queue_depth))
+		wake_up_all(&drvdata->output_wait);
+}
+
+/* Waits until everything queued so far has been sent */
+static void output_flush(struct drvdata *drvdata)
+{
+	unsigned int depth = READ_ONCE(drvdata->output_queue_depth);
+	unsigned int interval_ms = READ_ONCE(drvdata->output_interval_ms);
+	/* Plus the pacing of what is queued */
+	unsigned int timeout_ms = OUTPUT_FLUSH_TIMEOUT_MS + depth * interval_ms;
+
+	if (!wait_event_timeout(drvdata->output_wait,
+				!READ_ONCE(drvdata->output_queue_depth),
+				msecs_to_jiffies(timeout_ms)))
+		pr_warn("Timed out waiting for output reports\n");
+}
+
+static void send_init_command(struct drvdata *drvdata,
+			      enum init_command_id command)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(init_commands); i++)
+		if (init_commands[i] == command)
+			break;
+
+	if (WARN_ON(i == ARRAY_SIZE(init_commands)))
+		return;
+
+	mutex_lock(&drvdata->output_lock);
+
+	if (!__test_and_set_bit(i, &drvdata->pending_init))
+		WRITE_ONCE(drvdata->output_queue_depth,
+			   drvdata->output_queue_depth + 1);
+
+	output_kick(drvdata);
+
+	mutex_unlock(&drvdata->output_lock);
+}
+
+static void send_fan_speed(struct drvdata *drvdata, int channel, long pwm,
+			   enum output_priority priority)
+{
+	bool queued = false;
+	int i;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	drvdata->pending_speed_percent[channel] = pwm_to_percent(pwm);
+
+	/* Replaces a pending command, keeping the higher priority */
+	for (i = 0; i < OUTPUT_PRIORITY_COUNT; i++) {
+		if (__test_and_clear_bit(channel, &drvdata->pending_speed[i])) {
+			priority = min(priority, (enum output_priority)i);
+			queued = true;
+		}
+	}
+
+	__set_bit(channel, &drvdata->pending_speed[priority]);
+
+	if (!queued)
+		WRITE_ONCE(drvdata->output_queue_depth,
+			   drvdata->output_queue_depth + 1);
+
+	output_kick(drvdata);
+}
+
+/*
+ * Moves the duty sent to the device one step towards the commanded one:
+ * a spin-up kick when leaving 0 or an unknown duty, then no more than
+ * slew_rate per RAMP_INTERVAL_MS. Sets *pending if more steps are needed.
+ */
+static void step_output(struct drvdata *drvdata, int channel, bool *pending)
+{
+	struct channel_control *control = &drvdata->control[channel];
+	long target = min_t(long, drvdata->channel[channel].pwm,
+			    control->budget_limit);
+	long next = target;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	if (control->spinup) {
+		if (time_before(jiffies, control->spinup_until)) {
+			*pending = true;
+			return;
+		}
+
+		control->spinup = false;
+
+		/* No need to ramp down from the kick */
+		if (target <= control->output)
+			goto send;
+	}
+
+	if (control->output_set && control->output == target)
+		return;
+
+	/* Unknown output, e.g. the first write after probe, may be stopped */
+	if (control->spinup_ms &&
+	    (!control->output_set || control->output == 0) && target > 0 &&
+	    target < control->spinup_pwm) {
+		next = control->spinup_pwm;
+		control->spinup = true;
+		control->spinup_until =
+			jiffies + msecs_to_jiffies(control->spinup_ms);
+		*pending = true;
+		goto send;
+	}
+
+	if (control->slew_rate && control->output_set) {
+		long step = DIV_ROUND_UP(control->slew_rate * 255L *
+						 RAMP_INTERVAL_MS,
+					 100L * 1000L);
+
+		next = clamp_val(target, control->output - step,
+				 control->output + step);
+		if (next != target)
+			*pending = true;
+	}
+
+send:
+	send_fan_speed(drvdata, channel, next, control->priority);
+	control->output = next;
+	control->output_set = true;
+}
+
+static void ramp_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(to_delayed_work(work), struct drvdata, ramp_work);
+	bool pending = false;
+	int channel;
+
+	mutex_lock(&drvdata->output_lock);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++)
+		if (drvdata->channel[channel].pwm_set)
+			step_output(drvdata, channel, &pending);
+
+	mutex_unlock(&drvdata->output_lock);
+
+	if (pending)
+		schedule_delayed_work(&drvdata->ramp_work,
+				      msecs_to_jiffies(RAMP_INTERVAL_MS));
+}
+
+/*
+ * Estimated draw of the channel at pwm: from its calibration curve if it
+ * has one, otherwise the measured current scaled from the duty it runs
+ * at. With nothing to go by, e.g. a stopped fan, the channel rating.
+ */
+static void budget_draw(struct drvdata *drvdata, int channel,
+			const struct channel_status *channel_status, long pwm,
+			long *curr_ma, long *power_mw)
+{
+	struct channel_calibration *calibration =
+		&drvdata->calibration[channel];
+	struct channel_control *control = &drvdata->control[channel];
+	const struct calibration_point *p = calibration->curve;
+	long millivolt = channel_in_millivolt(channel_status) ?: 12000;
+	int i;
+
+	*curr_ma = 0;
+	*power_mw = 0;
+
+	if (pwm <= 0)
+		return;
+
+	if (channel_status->report_count &&
+	    channel_status->fan_type == FAN_TYPE_NONE)
+		return;
+
+	if (calibration->curve_size >= 2) {
+		for (i = 1; i < calibration->curve_size - 1; i++)
+			if (pwm <= p[i].pwm)
+				break;
+
+		*curr_ma = p[i - 1].curr_milliamp +
+			   (p[i].curr_milliamp - p[i - 1].curr_milliamp) *
+				   (pwm - p[i - 1].pwm) /
+				   (p[i].pwm - p[i - 1].pwm);
+		*curr_ma = max(*curr_ma, 0L);
+	} else if (control->output_set && control->output > 0 &&
+		   channel_status->report_count) {
+		*curr_ma = channel_curr_milliamp(channel_status) * pwm /
+			   control->output;
+	} else {
+		*curr_ma = drvdata->config->channel_milliamp;
+	}
+
+	*power_mw = *curr_ma * millivolt / 1000;
+}
+
+/*
+ * Hands out the budgets to channels by budget_priority, then index: each
+ * gets the highest duty up to the requested one whose estimated draw fits
+ * in what is left. Returns the channels whose budget_limit changed.
+ */
+static unsigned long budget_allocate(struct drvdata *drvdata)
+{
+	unsigned int curr_budget = READ_ONCE(drvdata->curr_budget_ma);
+	unsigned int power_budget = READ_ONCE(drvdata->power_budget_mw);
+	int channel_count = drvdata->config->channel_count;
+	struct channel_status channel_status[MAX_CHANNELS];
+	long curr_left = curr_budget;
+	long power_left = power_budget;
+	unsigned long changed = 0;
+	unsigned long done = 0;
+	unsigned long irq_flags;
+	long curr_ma, power_mw;
+	long lo, hi, mid;
+	int channel, next;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	memcpy(channel_status, drvdata->channel, sizeof(channel_status));
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	for (;;) {
+		struct channel_control *control;
+
+		next = -1;
+		for (channel = 0; channel < channel_count; channel++) {
+			if (test_bit(channel, &done))
+				continue;
+
+			if (next < 0 ||
+			    drvdata->control[channel].budget_priority >
+				    drvdata->control[next].budget_priority)
+				next = channel;
+		}
+
+		if (next < 0)
+			break;
+
+		__set_bit(next, &done);
+		control = &drvdata->control[next];
+
+		lo = 255;
+		if (curr_budget || power_budget) {
+			lo = 0;
+			hi = channel_status[next].pwm_set ?
+				     channel_status[next].pwm : 0;
+
+			while (lo < hi) {
+				mid = (lo + hi + 1) / 2;
+				budget_draw(drvdata, next,
+					    &channel_status[next], mid,
+					    &curr_ma, &power_mw);
+
+				if ((!curr_budget || curr_ma <= curr_left) &&
+				    (!power_budget || power_mw <= power_left))
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+
+			budget_draw(drvdata, next, &channel_status[next], lo,
+				    &curr_ma, &power_mw);
+			curr_left -= curr_ma;
+			power_left -= power_mw;
+		}
+
+		if (control->budget_limit != lo) {
+			control->budget_limit = lo;
+			__set_bit(next, &changed);
+		}
+	}
+
+	return changed;
+}
+
+/* Re-runs the allocation and moves changed channels to their new target */
+static void budget_update(struct drvdata *drvdata, unsigned long changed)
+{
+	bool pending = false;
+	int channel;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	changed |= budget_allocate(drvdata);
+
+	for_each_set_bit(channel, &changed, MAX_CHANNELS)
+		if (drvdata->channel[channel].pwm_set)
+			step_output(drvdata, channel, &pending);
+
+	if (pending)
+		schedule_delayed_work(&drvdata->ramp_work,
+				      msecs_to_jiffies(RAMP_INTERVAL_MS));
+}
+
+static void budget_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(work, struct drvdata, budget_work);
+
+	mutex_lock(&drvdata->output_lock);
+	budget_update(drvdata, 0);
+	mutex_unlock(&drvdata->output_lock);
+}
+
+static void __set_pwm(struct drvdata *drvdata, int channel, long pwm,
+		      enum output_priority priority)
+{
+	struct channel_status *channel_status = &drvdata->channel[channel];
+	unsigned long irq_flags;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	channel_status->pwm = pwm;
+	channel_status->pwm_set = true;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	drvdata->control[channel].priority = priority;
+	budget_update(drvdata, BIT(channel));
+}
+
+/* Any write other than the sweep's own aborts a calibration in progress */
+static void set_pwm(struct drvdata *drvdata, int channel, long pwm,
+		    enum output_priority priority)
+{
+	lockdep_assert_held(&drvdata->output_lock);
+
+	drvdata->calibration[channel].running = false;
+	__set_pwm(drvdata, channel, pwm, priority);
+}
+
+/*
+ * The device falls back to its default speed after suspend or reset.
+ * Send the duties it had again, back to back. Ramps in progress carry on
+ * from there.
+ */
+static void restore_pwm(struct drvdata *drvdata)
+{
+	int channel;
+
+	mutex_lock(&drvdata->output_lock);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		struct channel_control *control = &drvdata->control[channel];
+
+		if (control->output_set)
+			send_fan_speed(drvdata, channel, control->output,
+				       OUTPUT_PRIORITY_HIGH);
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+}
+
+static int detect_fans(struct drvdata *drvdata)
+{
+	unsigned long irq_flags;
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+
+	/* Would leave readers waiting on fans_detected again */
+	if (drvdata->removing) {
+		write_unlock_irqrestore(&drvdata->lock, irq_flags);
+		return -ENODEV;
+	}
+
+	drvdata->reported_channels = 0;
+	drvdata->fans_ready = false;
+	reinit_completion(&drvdata->fans_detected);
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	send_init_command(drvdata, INIT_COMMAND_ID_DETECT_FANS);
+	return 0;
+}
+
+/*
+ * Returns > 0 if all channels have reported, 0 on timeout, or a negative
+ * error if interrupted. Doesn't wait at all if ready_timeout_ms is 0.
+ */
+static long wait_fans_detected(struct drvdata *drvdata)
+{
+	unsigned int timeout_ms = READ_ONCE(drvdata->ready_timeout_ms);
+	long ret;
+
+	if (READ_ONCE(drvdata->fans_ready))
+		return 1;
+
+	if (!timeout_ms)
+		return 0;
+
+	atomic_inc(&drvdata->stream_waiters);
+	ret = wait_for_completion_interruptible_timeout(
+		&drvdata->fans_detected, msecs_to_jiffies(timeout_ms));
+	atomic_dec(&drvdata->stream_waiters);
+
+	return ret;
+}
+
+static void detect_fans_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(work, struct drvdata, detect_fans_work);
+
+	detect_fans(drvdata);
+	restore_pwm(drvdata);
+}
+
+static void redetect_work(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata, redetect_work);
+	unsigned int interval_ms = READ_ONCE(drvdata->redetect_interval_ms);
+
+	/* Unlike detect_fans(), keeps the current readings valid */
+	send_init_command(drvdata, INIT_COMMAND_ID_DETECT_FANS);
+	restore_pwm(drvdata);
+
+	if (interval_ms)
+		schedule_delayed_work(&drvdata->redetect_work,
+				      msecs_to_jiffies(interval_ms));
+}
+
+static void fan_event_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(work, struct drvdata, fan_event_work);
+	unsigned long irq_flags;
+	unsigned long changed;
+	int channel;
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	changed = drvdata->fan_type_changed;
+	drvdata->fan_type_changed = 0;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	/* Reports start coming in before probe registers hwmon */
+	if (IS_ERR_OR_NULL(drvdata->hwmon))
+		return;
+
+	for_each_set_bit(channel, &changed, MAX_CHANNELS) {
+		hwmon_notify_event(drvdata->hwmon, hwmon_fan, hwmon_fan_enable,
+				   channel);
+		hwmon_notify_event(drvdata->hwmon, hwmon_pwm, hwmon_pwm_mode,
+				   channel);
+	}
+
+	if (changed)
+		genl_notify_fan_type(drvdata, changed);
+}
+
+static void failsafe_kick(struct drvdata *drvdata)
+{
+	unsigned int timeout_ms = READ_ONCE(drvdata->failsafe_timeout_ms);
+
+	if (timeout_ms)
+		mod_delayed_work(system_wq, &drvdata->failsafe_work,
+				 msecs_to_jiffies(timeout_ms));
+	else
+		cancel_delayed_work(&drvdata->failsafe_work);
+}
+
+static void failsafe_work(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata, failsafe_work);
+	long failsafe_pwm = READ_ONCE(drvdata->failsafe_pwm);
+	int channel;
+
+	mutex_lock(&drvdata->output_lock);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		struct channel_status *channel_status =
+			&drvdata->channel[channel];
+
+		if (channel_status->pwm_set &&
+		    channel_status->pwm >= failsafe_pwm)
+			continue;
+
+		set_pwm(drvdata, channel, failsafe_pwm, OUTPUT_PRIORITY_HIGH);
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+
+	pr_warn("Heartbeat lost, fans set to failsafe speed\n");
+
+	WRITE_ONCE(drvdata->failsafe_active, true);
+	WRITE_ONCE(drvdata->failsafe_count, drvdata->failsafe_count + 1);
+	sysfs_notify(&drvdata->hwmon->kobj, NULL, "failsafe_active");
+	genl_notify_failsafe(drvdata, true);
+}
+
+/*
+ * Marks the readings as wanted, reopening the input stream if idle mode
+ * closed it. Until fresh reports come in, readers get the cached values;
+ * status_age_ms tells how old they are.
+ */
+static void stream_touch(struct drvdata *drvdata)
+{
+	unsigned int timeout_ms = READ_ONCE(drvdata->idle_timeout_ms);
+	int ret;
+
+	WRITE_ONCE(drvdata->stream_access, jiffies);
+
+	if (READ_ONCE(drvdata->removing))
+		return;
+
+	if (!READ_ONCE(drvdata->stream_open)) {
+		mutex_lock(&drvdata->stream_lock);
+
+		if (!drvdata->stream_open) {
+			ret = hid_hw_open(drvdata->hid);
+			if (ret)
+				pr_warn_ratelimited(
+					"Failed to reopen device: %d\n", ret);
+			else
+				WRITE_ONCE(drvdata->stream_open, true);
+		}
+
+		mutex_unlock(&drvdata->stream_lock);
+	}
+
+	/* No-op if already pending, idle_work checks stream_access itself */
+	if (timeout_ms)
+		schedule_delayed_work(&drvdata->idle_work,
+				      msecs_to_jiffies(timeout_ms));
+}
+
+static void stream_close(struct drvdata *drvdata)
+{
+	mutex_lock(&drvdata->stream_lock);
+
+	if (drvdata->stream_open) {
+		hid_hw_close(drvdata->hid);
+		WRITE_ONCE(drvdata->stream_open, false);
+	}
+
+	mutex_unlock(&drvdata->stream_lock);
+}
+
+/*
+ * Readers that count as reading all along: status subscribers,
+ * callbacks waiting for reports and pending set-and-confirms.
+ */
+static bool stream_wanted(struct drvdata *drvdata)
+{
+	unsigned int timeout_ms = READ_ONCE(drvdata->settle_timeout_ms);
+	ktime_t now = ktime_get();
+	unsigned long irq_flags;
+	bool wanted = false;
+	int channel;
+
+	if (genl_has_listeners(&genl_family, &init_net,
+			       NZXT_GRID_MCGRP_STATUS) ||
+	    atomic_read(&drvdata->stream_waiters))
+		return true;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		struct channel_settle *settle = &drvdata->settle[channel];
+
+		if (settle->armed && !settle->done &&
+		    ktime_ms_delta(now, settle->requested) < timeout_ms)
+			wanted = true;
+	}
+
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	return wanted;
+}
+
+static void idle_work(struct work_struct *work)
+{
+	struct drvdata *drvdata =
+		container_of(to_delayed_work(work), struct drvdata, idle_work);
+	unsigned int timeout_ms = READ_ONCE(drvdata->idle_timeout_ms);
+	unsigned long deadline;
+
+	if (!timeout_ms)
+		return;
+
+	/* Reopens the stream for a status subscriber that came meanwhile */
+	if (stream_wanted(drvdata)) {
+		stream_touch(drvdata);
+		return;
+	}
+
+	deadline = READ_ONCE(drvdata->stream_access) +
+		   msecs_to_jiffies(timeout_ms);
+
+	if (time_before(jiffies, deadline)) {
+		schedule_delayed_work(&drvdata->idle_work, deadline - jiffies);
+		return;
+	}
+
+	stream_close(drvdata);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+	/* No genl_family.bind yet, look for status subscribers instead */
+	schedule_delayed_work(&drvdata->idle_work,
+			      msecs_to_jiffies(IDLE_POLL_MS));
+#endif
+}
+
+static umode_t hwmon_is_visible(const void *data, enum hwmon_sensor_types type,
+				u32 attr, int channel)
+{
+	const struct drvdata *drvdata = data;
+	const struct device_config *config = drvdata->config;
+	u32 mask;
+
+	/*
+	 * Only absent channels are hidden. Visibility is fixed at
+	 * registration, before fan detection, and fans can be plugged in
+	 * later: unpopulated channels read as disabled, see hwmon_read().
+	 */
+	if (channel >= config->channel_count)
+		return 0;
+
+	switch (type) {
+	case hwmon_fan:
+		mask = config->fan_config;
+		break;
+	case hwmon_pwm:
+		mask = config->pwm_config;
+		break;
+	case hwmon_in:
+		mask = config->in_config;
+		break;
+	case hwmon_curr:
+		mask = config->curr_config;
+		break;
+	default:
+		return 0;
+	}
+
+	if (!(mask & BIT(attr)))
+		return 0;
+
+	if (type == hwmon_pwm && attr == hwmon_pwm_input)
+		return S_IWUSR | S_IRUGO;
+
+	return S_IRUGO;
+}
+
+static int hwmon_read_fan(struct channel_status *channel_status, u32 attr,
+			  long *val)
+{
+	switch (attr) {
+	case hwmon_fan_enable:
+		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
+		return 0;
+
+	case hwmon_fan_input:
+		*val = channel_speed_rpm(channel_status);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hwmon_read_pwm(struct channel_status *channel_status, u32 attr,
+			  long *val)
+{
+	switch (attr) {
+	case hwmon_pwm_input:
+		if (!channel_status->pwm_set)
+			return -ENODATA;
+
+		*val = channel_status->pwm;
+		return 0;
+
+	case hwmon_pwm_enable:
+		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
+		return 0;
+
+	case hwmon_pwm_mode:
+		*val = (channel_status->fan_type == FAN_TYPE_PWM) ? 1 : 0;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hwmon_read_in(struct channel_status *channel_status,
+			 struct channel_filter *filter, u32 attr, long *val)
+{
+	switch (attr) {
+	case hwmon_in_enable:
+		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
+		return 0;
+
+	case hwmon_in_input:
+		*val = channel_in_millivolt(channel_status);
+		return 0;
+
+	case hwmon_in_average:
+		*val = channel_average(filter, channel_status,
+				       FILTER_METRIC_IN);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hwmon_read_curr(struct channel_status *channel_status,
+			   struct channel_filter *filter, u32 attr, long *val)
+{
+	switch (attr) {
+	case hwmon_curr_enable:
+		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
+		return 0;
+
+	case hwmon_curr_input:
+		*val = channel_curr_milliamp(channel_status);
+		return 0;
+
+	case hwmon_curr_average:
+		*val = channel_average(filter, channel_status,
+				       FILTER_METRIC_CURR);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Attributes that still make sense on an unpopulated channel */
+static bool hwmon_attr_without_fan(enum hwmon_sensor_types type, u32 attr)
+{
+	switch (type) {
+	case hwmon_fan:
+		return attr == hwmon_fan_enable;
+	case hwmon_pwm:
+		/* The duty can be set before a fan is plugged in */
+		return true;
+	case hwmon_in:
+		return attr == hwmon_in_enable;
+	case hwmon_curr:
+		return attr == hwmon_curr_enable;
+	default:
+		return false;
+	}
+}
+
+static int hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+		      u32 attr, int channel, long *val)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct channel_status *channel_status =
+		get_channel_status(drvdata, channel);
+	/* pwmN is the commanded duty, not a reading: no need to wait */
+	bool reading = type != hwmon_pwm;
+	unsigned long irq_flags;
+	long wait;
+	int ret;
+
+	if (!channel_status)
+		return -EINVAL;
+
+	stream_touch(drvdata);
+
+	if (reading) {
+		wait = wait_fans_detected(drvdata);
+		if (wait < 0)
+			return wait;
+	}
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+
+	/*
+	 * With ready_timeout_ms set, report missing data instead of zeroes
+	 * for a channel that hasn't sent anything since the last detection.
+	 */
+	if (reading && READ_ONCE(drvdata->ready_timeout_ms) &&
+	    !test_bit(channel, &drvdata->reported_channels)) {
+		read_unlock_irqrestore(&drvdata->lock, irq_flags);
+		return -ENODATA;
+	}
+
+	/* No readings on an unpopulated channel, only that it's disabled */
+	if (channel_status->fan_type == FAN_TYPE_NONE &&
+	    !hwmon_attr_without_fan(type, attr)) {
+		read_unlock_irqrestore(&drvdata->lock, irq_flags);
+		return -ENODATA;
+	}
+
+	switch (type) {
+	case hwmon_fan:
+		ret = hwmon_read_fan(channel_status, attr, val);
+		break;
+
+	case hwmon_pwm:
+		ret = hwmon_read_pwm(channel_status, attr, val);
+		break;
+
+	case hwmon_in:
+		ret = hwmon_read_in(channel_status, &drvdata->filter[channel],
+				    attr, val);
+		break;
+
+	case hwmon_curr:
+		ret = hwmon_read_curr(channel_status,
+				      &drvdata->filter[channel], attr, val);
+		break;
+
+	default:
+		ret = -EINVAL;
+	}
+
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	return ret;
+}
+
+static int hwmon_write_pwm_input(struct drvdata *drvdata, int channel, long val)
+{
+	struct channel_status *channel_status =
+		get_channel_status(drvdata, channel);
+
+	if (!channel_status)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->output_lock);
+	set_pwm(drvdata, channel, clamp_val(val, 0, 255),
+		OUTPUT_PRIORITY_NORMAL);
+	mutex_unlock(&drvdata->output_lock);
+
+	return 0;
+}
+
+static void set_group_pwm(struct drvdata *drvdata, int group, long val)
+{
+	struct pwm_group *pwm_group = &drvdata->group[group];
+	int channel;
+
+	mutex_lock(&drvdata->output_lock);
+
+	pwm_group->pwm = val;
+	pwm_group->pwm_set = true;
+
+	for_each_set_bit(channel, &pwm_group->channels, MAX_CHANNELS) {
+		struct channel_control *control = &drvdata->control[channel];
+		long pwm = val * control->group_scale / 100 +
+			   control->group_offset;
+
+		set_pwm(drvdata, channel, clamp_val(pwm, 0, 255),
+			OUTPUT_PRIORITY_NORMAL);
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+}
+
+static long calibration_step_pwm(int step)
+{
+	return DIV_ROUND_CLOSEST(step * 255, CALIBRATION_STEPS - 1);
+}
+
+static void calibration_start_step(struct drvdata *drvdata, int channel)
+{
+	struct channel_calibration *calibration =
+		&drvdata->calibration[channel];
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	calibration->step_reached = false;
+	calibration->step_start = jiffies;
+	calibration->stable_reports = 0;
+
+	__set_pwm(drvdata, channel, calibration_step_pwm(calibration->step),
+		  OUTPUT_PRIORITY_NORMAL);
+}
+
+static void calibration_stop(struct drvdata *drvdata, int channel)
+{
+	struct channel_calibration *calibration =
+		&drvdata->calibration[channel];
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	calibration->running = false;
+
+	if (calibration->saved_pwm_set)
+		__set_pwm(drvdata, channel, calibration->saved_pwm,
+			  OUTPUT_PRIORITY_NORMAL);
+}
+
+static void calibration_poll(struct drvdata *drvdata, int channel)
+{
+	struct channel_calibration *calibration =
+		&drvdata->calibration[channel];
+	struct channel_status *channel_status = &drvdata->channel[channel];
+	struct channel_control *control = &drvdata->control[channel];
+	long step_pwm = calibration_step_pwm(calibration->step);
+	unsigned long settle_start;
+	unsigned long settle_end;
+	unsigned int report_count;
+	unsigned long irq_flags;
+	long speed_rpm;
+	long curr_milliamp;
+	bool reached;
+
+	lockdep_assert_held(&drvdata->output_lock);
+
+	/*
+	 * Settling starts once the step duty is sent, after a slew-limited
+	 * ramp or a kick. Falling off it (a budget cap) starts over. Give up
+	 * if the step can't be reached at all.
+	 */
+	reached = control->output_set && control->output == step_pwm &&
+		  !control->spinup;
+	if (reached != calibration->step_reached) {
+		calibration->step_reached = reached;
+		calibration->step_start = jiffies;
+		calibration->stable_reports = 0;
+	}
+
+	settle_start = calibration->step_start +
+		       msecs_to_jiffies(CALIBRATION_MIN_SETTLE_MS);
+	settle_end = calibration->step_start +
+		     msecs_to_jiffies(CALIBRATION_MAX_SETTLE_MS);
+
+	if (!reached) {
+		if (!time_before(jiffies, settle_end)) {
+			pr_warn("Channel %d can't reach calibration duty %ld\n",
+				channel, step_pwm);
+			calibration_stop(drvdata, channel);
+		}
+		return;
+	}
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	report_count = channel_status->report_count;
+	speed_rpm = channel_speed_rpm(channel_status);
+	curr_milliamp = channel_curr_milliamp(channel_status);
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	if (time_before(jiffies, settle_start))
+		return;
+
+	/* Only a fresh status report counts as a sample */
+	if (report_count != calibration->report_count) {
+		if (abs(speed_rpm - calibration->last_rpm) <=
+		    CALIBRATION_RPM_TOLERANCE)
+			calibration->stable_reports++;
+		else
+			calibration->stable_reports = 0;
+
+		calibration->report_count = report_count;
+		calibration->last_rpm = speed_rpm;
+	}
+
+	if (calibration->stable_reports < CALIBRATION_STABLE_REPORTS &&
+	    time_before(jiffies, settle_end))
+		return;
+
+	calibration->sweep[calibration->step] = (struct calibration_point){
+		.pwm = step_pwm,
+		.speed_rpm = speed_rpm,
+		.curr_milliamp = curr_milliamp,
+	};
+
+	if (++calibration->step < CALIBRATION_STEPS) {
+		calibration_start_step(drvdata, channel);
+		return;
+	}
+
+	memcpy(calibration->curve, calibration->sweep,
+	       sizeof(calibration->curve));
+	calibration->curve_size = CALIBRATION_STEPS;
+	calibration_stop(drvdata, channel);
+}
+
+static void calibration_work(struct work_struct *work)
+{
+	struct drvdata *drvdata = container_of(to_delayed_work(work),
+					       struct drvdata,
+					       calibration_work);
+	bool running = false;
+	int channel;
+
+	/* The sweep needs reports */
+	stream_touch(drvdata);
+
+	mutex_lock(&drvdata->output_lock);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		if (!drvdata->calibration[channel].running)
+			continue;
+
+		calibration_poll(drvdata, channel);
+		running |= drvdata->calibration[channel].running;
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+
+	if (running)
+		schedule_delayed_work(&drvdata->calibration_work,
+				      msecs_to_jiffies(CALIBRATION_POLL_MS));
+}
+
+static int calibration_start(struct drvdata *drvdata, int channel)
+{
+	struct channel_calibration *calibration =
+		&drvdata->calibration[channel];
+	struct channel_status *channel_status = &drvdata->channel[channel];
+	unsigned long irq_flags;
+
+	mutex_lock(&drvdata->output_lock);
+
+	if (calibration->running) {
+		mutex_unlock(&drvdata->output_lock);
+		return -EBUSY;
+	}
+
+	calibration->running = true;
+	calibration->step = 0;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	calibration->report_count = channel_status->report_count;
+	calibration->last_rpm = channel_speed_rpm(channel_status);
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	calibration->saved_pwm = channel_status->pwm;
+	calibration->saved_pwm_set = channel_status->pwm_set;
+	calibration_start_step(drvdata, channel);
+
+	mutex_unlock(&drvdata->output_lock);
+
+	schedule_delayed_work(&drvdata->calibration_work,
+			      msecs_to_jiffies(CALIBRATION_POLL_MS));
+	return 0;
+}
+
+static int hwmon_write_pwm(struct drvdata *drvdata, u32 attr, int channel,
+			   long val)
+{
+	switch (attr) {
+	case hwmon_pwm_input:
+		return hwmon_write_pwm_input(drvdata, channel, val);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+		       u32 attr, int channel, long val)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_pwm:
+		return hwmon_write_pwm(drvdata, attr, channel, val);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct hwmon_ops hwmon_ops = {
+	.is_visible = hwmon_is_visible,
+	.read = hwmon_read,
+	.write = hwmon_write,
+};
+
+/* Everything any model has, hwmon_is_visible() hides the rest */
+#define FAN_CHANNEL (HWMON_F_INPUT | HWMON_F_ENABLE)
+#define PWM_CHANNEL (HWMON_PWM_MODE | HWMON_PWM_INPUT | HWMON_PWM_ENABLE)
+#define IN_CHANNEL (HWMON_I_INPUT | HWMON_I_ENABLE | HWMON_I_AVERAGE)
+#define CURR_CHANNEL (HWMON_C_INPUT | HWMON_C_ENABLE | HWMON_C_AVERAGE)
+
+/* Like HWMON_CHANNEL_INFO(), with MAX_CHANNELS copies of mask */
+#define ALL_CHANNELS_INFO(sensor, mask)                            \
+	(&(const struct hwmon_channel_info){                       \
+		.type = hwmon_##sensor,                            \
+		.config = (const u32[MAX_CHANNELS + 1]){           \
+			[0 ... MAX_CHANNELS - 1] = (mask),         \
+		},                                                 \
+	})
+
+static const struct hwmon_channel_info *channel_info[] = {
+	ALL_CHANNELS_INFO(fan, FAN_CHANNEL),
+	ALL_CHANNELS_INFO(pwm, PWM_CHANNEL),
+	ALL_CHANNELS_INFO(in, IN_CHANNEL),
+	ALL_CHANNELS_INFO(curr, CURR_CHANNEL),
+	NULL
+};
+
+static const struct hwmon_chip_info chip_info = {
+	.ops = &hwmon_ops,
+	.info = channel_info,
+};
+
+enum {
+	DEVICE_CONFIG_GRID_V3,
+	DEVICE_CONFIG_SMART_DEVICE_V1,
+	DEVICE_CONFIG_COUNT
+};
+
+static const struct device_config device_configs[DEVICE_CONFIG_COUNT] = {
+	[DEVICE_CONFIG_GRID_V3] = {
+		.channel_count = 6,
+		.fan_config = FAN_CHANNEL,
+		.pwm_config = PWM_CHANNEL,
+		.in_config = IN_CHANNEL,
+		.curr_config = CURR_CHANNEL,
+		.channel_milliamp = 1000,
+	},
+	[DEVICE_CONFIG_SMART_DEVICE_V1] = {
+		.channel_count = 3,
+		.fan_config = FAN_CHANNEL,
+		.pwm_config = PWM_CHANNEL,
+		.in_config = IN_CHANNEL,
+		.curr_config = CURR_CHANNEL,
+		.channel_milliamp = 1000,
+	},
+};
+
+static const struct hid_device_id hid_id_table[] = {
+	{ HID_USB_DEVICE(USB_VENDOR_ID_NZXT, USB_PRODUCT_ID_NZXT_GRID_V3),
+	  .driver_data = DEVICE_CONFIG_GRID_V3 },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_NZXT,
+			 USB_PRODUCT_ID_NZXT_SMART_DEVICE_V1),
+	  .driver_data = DEVICE_CONFIG_SMART_DEVICE_V1 },
+	{}
+};
+
+static void process_input_report(struct drvdata *drvdata, u8 *data, int size)
+{
+	uint8_t report_id;
+
+	/*
+	 * This runs in interrupt context on whatever the device sends,
+	 * so nothing may be read before the size is known to cover it,
+	 * and a misbehaving device must not be able to flood the log.
+	 */
+	if (size < 1) {
+		pr_warn_ratelimited("Empty input report\n");
+		return;
+	}
+
+	report_id = data[0];
+
+	if (report_id != INPUT_REPORT_ID_STATUS) {
+		pr_warn_ratelimited("Unknown input report: type %#x, size %d\n",
+				    report_id, size);
+		return;
+	}
+
+	if (size != sizeof(struct status_report)) {
+		pr_warn_ratelimited("Invalid status report size %d\n", size);
+		return;
+	}
+
+	update_status(drvdata, (struct status_report *)data);
+}
+
+static int hid_raw_event(struct hid_device *hdev, struct hid_report *report,
+			 u8 *data, int size)
+{
+	struct drvdata *drvdata = hid_get_drvdata(hdev);
+
+	capture_report(drvdata, CAPTURE_DIRECTION_IN, data, size);
+	process_input_report(drvdata, data, size);
+	return 0;
+}
+
+static void capture_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct capture, kref));
+}
+
+static void capture_put(void *data)
+{
+	struct capture *capture = data;
+
+	kref_put(&capture->kref, capture_free);
+}
+
+static int capture_open(struct inode *inode, struct file *file)
+{
+	struct capture *capture = inode->i_private;
+	unsigned long irq_flags;
+	int ret;
+
+	if (test_and_set_bit(0, &capture->busy))
+		return -EBUSY;
+
+	ret = kfifo_alloc(&capture->fifo, CAPTURE_FIFO_SIZE, GFP_KERNEL);
+	if (ret) {
+		clear_bit(0, &capture->busy);
+		return ret;
+	}
+
+	spin_lock_irqsave(&capture->lock, irq_flags);
+	if (capture->removed) {
+		spin_unlock_irqrestore(&capture->lock, irq_flags);
+		kfifo_free(&capture->fifo);
+		clear_bit(0, &capture->busy);
+		return -ENODEV;
+	}
+	capture->dropped = 0;
+	WRITE_ONCE(capture->active, true);
+	kref_get(&capture->kref);
+	spin_unlock_irqrestore(&capture->lock, irq_flags);
+
+	file->private_data = capture;
+	return stream_open(inode, file);
+}
+
+static int capture_release(struct inode *inode, struct file *file)
+{
+	struct capture *capture = file->private_data;
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&capture->lock, irq_flags);
+	WRITE_ONCE(capture->active, false);
+	spin_unlock_irqrestore(&capture->lock, irq_flags);
+
+	kfifo_free(&capture->fifo);
+	clear_bit(0, &capture->busy);
+	capture_put(capture);
+	return 0;
+}
+
+static ssize_t capture_read(struct file *file, char __user *buf, size_t count,
+			    loff_t *ppos)
+{
+	struct capture *capture = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	ret = mutex_lock_interruptible(&capture->read_lock);
+	if (ret)
+		return ret;
+
+	if (kfifo_is_empty(&capture->fifo)) {
+		ret = -ENODEV;
+		if (READ_ONCE(capture->removed))
+			goto out_unlock;
+
+		ret = -EAGAIN;
+		if (file->f_flags & O_NONBLOCK)
+			goto out_unlock;
+
+		ret = wait_event_interruptible(
+			capture->wait, !kfifo_is_empty(&capture->fifo) ||
+					       READ_ONCE(capture->removed));
+		if (ret)
+			goto out_unlock;
+
+		/* What was captured before removal is still returned */
+		ret = -ENODEV;
+		if (kfifo_is_empty(&capture->fifo))
+			goto out_unlock;
+	}
+
+	ret = kfifo_to_user(&capture->fifo, buf, count, &copied);
+	if (!ret)
+		ret = copied;
+
+out_unlock:
+	mutex_unlock(&capture->read_lock);
+	return ret;
+}
+
+/* Fail readers so debugfs removal doesn't wait for a report forever */
+static void capture_remove(struct capture *capture)
+{
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&capture->lock, irq_flags);
+	capture->removed = true;
+	WRITE_ONCE(capture->active, false);
+	spin_unlock_irqrestore(&capture->lock, irq_flags);
+
+	wake_up_all(&capture->wait);
+}
+
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.open = capture_open,
+	.release = capture_release,
+	.read = capture_read,
+};
+
+/*
+ * Replay: each write is processed as one input report, exactly as if it
+ * came from the device. Pacing is up to the writer.
+ */
+static ssize_t inject_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct drvdata *drvdata = file->private_data;
+	u8 data[INJECT_MAX_REPORT_SIZE];
+
+	if (count > sizeof(data))
+		return -EINVAL;
+
+	if (copy_from_user(data, buf, count))
+		return -EFAULT;
+
+	process_input_report(drvdata, data, count);
+	return count;
+}
+
+static const struct file_operations inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = inject_write,
+};
+
+static void debugfs_init(struct drvdata *drvdata)
+{
+	drvdata->debugfs =
+		debugfs_create_dir(dev_name(&drvdata->hid->dev), debugfs_root);
+
+	debugfs_create_file("capture", 0400, drvdata->debugfs, drvdata->capture,
+			    &capture_fops);
+	debugfs_create_file("inject", 0200, drvdata->debugfs, drvdata,
+			    &inject_fops);
+	debugfs_create_u32("capture_dropped", 0400, drvdata->debugfs,
+			   &drvdata->capture->dropped);
+}
+
+/*
+ * Aggregate interface over all bound devices, /dev/nzxt_grid.
+ *
+ * Reading at offset 0 takes a new snapshot of every channel of every
+ * device, one line per channel. Each write is a list of lines of the form
+ * "<hwmon device|*> <all|pwmN|groupN> <pwm>".
+ */
+
+#define AGGREGATE_LINE_MAX 96
+
+/* Per open file, shared by its users, so under lock */
+struct aggregate_snapshot {
+	struct mutex lock;
+	char *buf;
+	size_t len;
+	int seq;
+};
+
+static size_t aggregate_snapshot_device(struct drvdata *drvdata, char *buf,
+					size_t size)
+{
+	struct channel_status channel[MAX_CHANNELS];
+	unsigned long irq_flags;
+	size_t len = 0;
+	int i;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	memcpy(channel, drvdata->channel, sizeof(channel));
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	/* -1 for what isn't there: readings without a fan, pwm not set */
+	for (i = 0; i < drvdata->config->channel_count; i++) {
+		bool fan = channel[i].fan_type != FAN_TYPE_NONE;
+
+		len += scnprintf(buf + len, size - len,
+				 "%s %d %d %ld %ld %ld %d\n",
+				 dev_name(drvdata->hwmon), i + 1,
+				 channel[i].fan_type,
+				 fan ? channel_speed_rpm(&channel[i]) : -1,
+				 fan ? channel_in_millivolt(&channel[i]) : -1,
+				 fan ? channel_curr_milliamp(&channel[i]) : -1,
+				 channel[i].pwm_set ? channel[i].pwm : -1);
+	}
+
+	return len;
+}
+
+static int aggregate_snapshot_update(struct aggregate_snapshot *snapshot)
+{
+	struct drvdata *drvdata;
+	size_t size = AGGREGATE_LINE_MAX;
+	int seq = atomic_read(&aggregate_seq);
+	size_t len;
+	char *buf;
+
+	lockdep_assert_held(&snapshot->lock);
+
+	mutex_lock(&devices_lock);
+
+	list_for_each_entry(drvdata, &devices, node) {
+		stream_touch(drvdata);
+		size += drvdata->config->channel_count * AGGREGATE_LINE_MAX;
+	}
+
+	buf = kvmalloc(size, GFP_KERNEL);
+	if (!buf) {
+		mutex_unlock(&devices_lock);
+		return -ENOMEM;
+	}
+
+	len = scnprintf(buf, size,
+			"# device channel fan_type rpm in_mV curr_mA pwm\n");
+
+	list_for_each_entry(drvdata, &devices, node)
+		len += aggregate_snapshot_device(drvdata, buf + len,
+						 size - len);
+
+	mutex_unlock(&devices_lock);
+
+	kvfree(snapshot->buf);
+	snapshot->buf = buf;
+	snapshot->len = len;
+	snapshot->seq = seq;
+	return 0;
+}
+
+static int aggregate_set(struct drvdata *drvdata, const char *target,
+			 long pwm)
+{
+	int index;
+
+	if (!strcmp(target, "all")) {
+		mutex_lock(&drvdata->output_lock);
+
+		for (index = 0; index < drvdata->config->channel_count; index++)
+			set_pwm(drvdata, index, pwm, OUTPUT_PRIORITY_NORMAL);
+
+		mutex_unlock(&drvdata->output_lock);
+		return 0;
+	}
+
+	if (sscanf(target, "pwm%d", &index) == 1) {
+		if (index < 1 || index > drvdata->config->channel_count)
+			return -EINVAL;
+
+		return hwmon_write_pwm_input(drvdata, index - 1, pwm);
+	}
+
+	if (sscanf(target, "group%d", &index) == 1) {
+		if (index < 1 || index > MAX_GROUPS)
+			return -EINVAL;
+
+		set_group_pwm(drvdata, index - 1, pwm);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int aggregate_command(char *line)
+{
+	struct drvdata *drvdata;
+	char device[32];
+	char target[16];
+	bool matched = false;
+	long pwm;
+	int ret;
+
+	lockdep_assert_held(&devices_lock);
+
+	if (sscanf(line, "%31s %15s %ld", device, target, &pwm) != 3)
+		return -EINVAL;
+
+	if (pwm < 0 || pwm > 255)
+		return -EINVAL;
+
+	list_for_each_entry(drvdata, &devices, node) {
+		if (strcmp(device, "*") &&
+		    strcmp(device, dev_name(drvdata->hwmon)))
+			continue;
+
+		matched = true;
+
+		ret = aggregate_set(drvdata, target, pwm);
+		if (ret)
+			return ret;
+	}
+
+	return matched ? 0 : -ENODEV;
+}
+
+static int aggregate_open(struct inode *inode, struct file *file)
+{
+	struct aggregate_snapshot *snapshot =
+		kzalloc(sizeof(*snapshot), GFP_KERNEL);
+
+	if (!snapshot)
+		return -ENOMEM;
+
+	mutex_init(&snapshot->lock);
+	file->private_data = snapshot;
+	return 0;
+}
+
+static int aggregate_release(struct inode *inode, struct file *file)
+{
+	struct aggregate_snapshot *snapshot = file->private_data;
+
+	kvfree(snapshot->buf);
+	mutex_destroy(&snapshot->lock);
+	kfree(snapshot);
+	return 0;
+}
+
+static ssize_t aggregate_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct aggregate_snapshot *snapshot = file->private_data;
+	ssize_t ret = 0;
+
+	mutex_lock(&snapshot->lock);
+
+	if (*ppos == 0)
+		ret = aggregate_snapshot_update(snapshot);
+
+	if (!ret)
+		ret = simple_read_from_buffer(buf, count, ppos, snapshot->buf,
+					      snapshot->len);
+
+	mutex_unlock(&snapshot->lock);
+
+	return ret;
+}
+
+/* Readable once readings changed since the last snapshot */
+static __poll_t aggregate_poll(struct file *file, poll_table *wait)
+{
+	struct aggregate_snapshot *snapshot = file->private_data;
+	int seq;
+
+	poll_wait(file, &aggregate_wait, wait);
+
+	mutex_lock(&snapshot->lock);
+	seq = snapshot->seq;
+	mutex_unlock(&snapshot->lock);
+
+	if (atomic_read(&aggregate_seq) != seq)
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static ssize_t aggregate_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	char *buf, *cursor, *line;
+	int ret = 0;
+
+	if (count > PAGE_SIZE)
+		return -EINVAL;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	cursor = buf;
+
+	mutex_lock(&devices_lock);
+
+	while ((line = strsep(&cursor, "\n"))) {
+		if (!*line)
+			continue;
+
+		ret = aggregate_command(line);
+		if (ret)
+			break;
+	}
+
+	mutex_unlock(&devices_lock);
+
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+static const struct file_operations aggregate_fops = {
+	.owner = THIS_MODULE,
+	.open = aggregate_open,
+	.release = aggregate_release,
+	.read = aggregate_read,
+	.write = aggregate_write,
+	.poll = aggregate_poll,
+	.llseek = default_llseek,
+};
+
+static struct miscdevice aggregate_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = KBUILD_MODNAME,
+	.fops = &aggregate_fops,
+	.mode = 0600,
+};
+
+static const struct nla_policy
+	genl_channel_policy[NZXT_GRID_CHANNEL_ATTR_MAX + 1] = {
+	[NZXT_GRID_CHANNEL_ATTR_INDEX] =
+		NLA_POLICY_RANGE(NLA_U8, 1, MAX_CHANNELS),
+	[NZXT_GRID_CHANNEL_ATTR_PWM] = { .type = NLA_U8 },
+};
+
+static const struct nla_policy genl_policy[NZXT_GRID_ATTR_MAX + 1] = {
+	[NZXT_GRID_ATTR_DEVICE] = { .type = NLA_NUL_STRING, .len = 31 },
+	[NZXT_GRID_ATTR_CHANNEL] = NLA_POLICY_NESTED(genl_channel_policy),
+};
+
+static struct drvdata *genl_find_device(struct genl_info *info)
+{
+	struct nlattr *name = info->attrs[NZXT_GRID_ATTR_DEVICE];
+	struct drvdata *drvdata;
+
+	lockdep_assert_held(&devices_lock);
+
+	if (!name) {
+		NL_SET_ERR_MSG(info->extack, "Device name is required");
+		return ERR_PTR(-EINVAL);
+	}
+
+	list_for_each_entry(drvdata, &devices, node) {
+		if (!nla_strcmp(name, dev_name(drvdata->hwmon)))
+			return drvdata;
+	}
+
+	NL_SET_ERR_MSG_ATTR(info->extack, name, "No such device");
+	return ERR_PTR(-ENODEV);
+}
+
+/* All channels of the device that have reported, from one lock hold */
+static int genl_put_device(struct sk_buff *skb, struct drvdata *drvdata)
+{
+	struct channel_status channel[MAX_CHANNELS];
+	unsigned long irq_flags;
+	int index;
+
+	stream_touch(drvdata);
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	memcpy(channel, drvdata->channel, sizeof(channel));
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	if (nla_put_string(skb, NZXT_GRID_ATTR_DEVICE,
+			   dev_name(drvdata->hwmon)))
+		return -EMSGSIZE;
+
+	for (index = 0; index < drvdata->config->channel_count; index++) {
+		if (!channel[index].report_count)
+			continue;
+
+		if (genl_put_status(skb, index, &channel[index]))
+			return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+static int genl_get_status(struct sk_buff *skb, struct genl_info *info)
+{
+	struct drvdata *drvdata;
+	struct sk_buff *reply;
+	void *hdr;
+	int ret;
+
+	reply = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(reply, info->snd_portid, info->snd_seq, &genl_family,
+			  0, NZXT_GRID_CMD_GET_STATUS);
+	if (!hdr) {
+		ret = -EMSGSIZE;
+		goto err_free;
+	}
+
+	mutex_lock(&devices_lock);
+
+	drvdata = genl_find_device(info);
+	if (IS_ERR(drvdata))
+		ret = PTR_ERR(drvdata);
+	else
+		ret = genl_put_device(reply, drvdata);
+
+	mutex_unlock(&devices_lock);
+
+	if (ret)
+		goto err_free;
+
+	genlmsg_end(reply, hdr);
+	return genlmsg_reply(reply, info);
+
+err_free:
+	nlmsg_free(reply);
+	return ret;
+}
+
+/* One message per device, cb->args[0] is the number of devices done */
+static int genl_dump_status(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct drvdata *drvdata;
+	long index = 0;
+	void *hdr;
+
+	mutex_lock(&devices_lock);
+
+	list_for_each_entry(drvdata, &devices, node) {
+		if (index++ < cb->args[0])
+			continue;
+
+		hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid,
+				  cb->nlh->nlmsg_seq, &genl_family,
+				  NLM_F_MULTI, NZXT_GRID_CMD_GET_STATUS);
+		if (!hdr)
+			break;
+
+		if (genl_put_device(skb, drvdata)) {
+			genlmsg_cancel(skb, hdr);
+			break;
+		}
+
+		genlmsg_end(skb, hdr);
+		cb->args[0] = index;
+	}
+
+	mutex_unlock(&devices_lock);
+
+	return skb->len;
+}
+
+/*
+ * Checks every NZXT_GRID_ATTR_CHANNEL entry, then applies them all under
+ * one output_lock hold, so the commands go out back to back.
+ */
+static int genl_set_pwm(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr *tb[NZXT_GRID_CHANNEL_ATTR_MAX + 1];
+	long pwm[MAX_CHANNELS];
+	unsigned long channels = 0;
+	struct drvdata *drvdata;
+	struct nlattr *nla;
+	int channel;
+	int rem;
+	int ret;
+
+	mutex_lock(&devices_lock);
+
+	drvdata = genl_find_device(info);
+	if (IS_ERR(drvdata)) {
+		ret = PTR_ERR(drvdata);
+		goto out_unlock;
+	}
+
+	nlmsg_for_each_attr(nla, info->nlhdr, GENL_HDRLEN, rem) {
+		if (nla_type(nla) != NZXT_GRID_ATTR_CHANNEL)
+			continue;
+
+		ret = nla_parse_nested(tb, NZXT_GRID_CHANNEL_ATTR_MAX, nla,
+				       genl_channel_policy, info->extack);
+		if (ret)
+			goto out_unlock;
+
+		if (!tb[NZXT_GRID_CHANNEL_ATTR_INDEX] ||
+		    !tb[NZXT_GRID_CHANNEL_ATTR_PWM]) {
+			NL_SET_ERR_MSG_ATTR(info->extack, nla,
+					    "Channel index and pwm required");
+			ret = -EINVAL;
+			goto out_unlock;
+		}
+
+		channel = nla_get_u8(tb[NZXT_GRID_CHANNEL_ATTR_INDEX]) - 1;
+		if (channel >= drvdata->config->channel_count) {
+			NL_SET_ERR_MSG_ATTR(info->extack,
+					    tb[NZXT_GRID_CHANNEL_ATTR_INDEX],
+					    "No such channel");
+			ret = -EINVAL;
+			goto out_unlock;
+		}
+
+		pwm[channel] = nla_get_u8(tb[NZXT_GRID_CHANNEL_ATTR_PWM]);
+		__set_bit(channel, &channels);
+	}
+
+	ret = 0;
+
+	mutex_lock(&drvdata->output_lock);
+
+	for_each_set_bit(channel, &channels, MAX_CHANNELS)
+		set_pwm(drvdata, channel, pwm[channel], OUTPUT_PRIORITY_NORMAL);
+
+	mutex_unlock(&drvdata->output_lock);
+
+out_unlock:
+	mutex_unlock(&devices_lock);
+	return ret;
+}
+
+static const struct genl_small_ops genl_ops[] = {
+	{
+		.cmd = NZXT_GRID_CMD_SET_PWM,
+		.doit = genl_set_pwm,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = NZXT_GRID_CMD_GET_STATUS,
+		.doit = genl_get_status,
+		.dumpit = genl_dump_status,
+	},
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+/* A new status subscriber wants reports, wake up idle devices */
+static int genl_bind(int mcgrp)
+{
+	struct drvdata *drvdata;
+
+	if (mcgrp != NZXT_GRID_MCGRP_STATUS)
+		return 0;
+
+	mutex_lock(&devices_lock);
+
+	list_for_each_entry(drvdata, &devices, node)
+		stream_touch(drvdata);
+
+	mutex_unlock(&devices_lock);
+
+	return 0;
+}
+#endif
+
+static const struct genl_multicast_group genl_mcgrps[] = {
+	[NZXT_GRID_MCGRP_STATUS] = { .name = "status" },
+	[NZXT_GRID_MCGRP_EVENTS] = { .name = "events" },
+};
+
+static struct genl_family genl_family __ro_after_init = {
+	.name = NZXT_GRID_GENL_NAME,
+	.version = NZXT_GRID_GENL_VERSION,
+	.maxattr = NZXT_GRID_ATTR_MAX,
+	.policy = genl_policy,
+	.module = THIS_MODULE,
+	.small_ops = genl_ops,
+	.n_small_ops = ARRAY_SIZE(genl_ops),
+	.mcgrps = genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(genl_mcgrps),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	.bind = genl_bind,
+#endif
+};
+
+#ifdef CONFIG_PM
+
+static int hid_resume(struct hid_device *hdev)
+{
+	struct drvdata *drvdata = hid_get_drvdata(hdev);
+	restore_pwm(drvdata);
+	output_flush(drvdata);
+	/* Give the daemon a full timeout to come back after resume */
+	failsafe_kick(drvdata);
+	return 0;
+}
+
+static int hid_reset_resume(struct hid_device *hdev)
+{
+	struct drvdata *drvdata = hid_get_drvdata(hdev);
+	unsigned long irq_flags;
+
+	/* The firmware may have been updated, look at the version again */
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	drvdata->decode_status = NULL;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	/* Fan detection re-sends the duties once more when it's done */
+	restore_pwm(drvdata);
+	output_flush(drvdata);
+	schedule_work(&drvdata->detect_fans_work);
+	failsafe_kick(drvdata);
+	return 0;
+}
+
+#endif
+
+static ssize_t detect_fans_store(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	long wait;
+	int ret;
+
+	stream_touch(drvdata);
+
+	ret = detect_fans(drvdata);
+
+	if (ret)
+		return ret;
+
+	if (!READ_ONCE(drvdata->ready_timeout_ms))
+		return len;
+
+	wait = wait_fans_detected(drvdata);
+	if (wait < 0)
+		return wait;
+
+	return wait ? len : -ETIMEDOUT;
+}
+
+static DEVICE_ATTR_WO(detect_fans);
+
+static ssize_t fans_ready_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(drvdata->fans_ready));
+}
+
+static DEVICE_ATTR_RO(fans_ready);
+
+static ssize_t ready_timeout_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->ready_timeout_ms));
+}
+
+static ssize_t ready_timeout_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->ready_timeout_ms, val);
+	return len;
+}
+
+static DEVICE_ATTR_RW(ready_timeout_ms);
+
+static ssize_t idle_timeout_ms_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->idle_timeout_ms));
+}
+
+static ssize_t idle_timeout_ms_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->idle_timeout_ms, val);
+
+	/* Reopens the stream if needed, and restarts the idle timer */
+	stream_touch(drvdata);
+	if (val)
+		mod_delayed_work(system_wq, &drvdata->idle_work,
+				 msecs_to_jiffies(val));
+	else
+		cancel_delayed_work(&drvdata->idle_work);
+	return len;
+}
+
+static DEVICE_ATTR_RW(idle_timeout_ms);
+
+/* Milliseconds since the least recently reported channel last reported */
+static ssize_t status_age_ms_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned long oldest = jiffies;
+	unsigned long irq_flags;
+	bool reported = false;
+	int channel;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		struct channel_status *channel_status =
+			&drvdata->channel[channel];
+
+		if (!channel_status->report_count)
+			continue;
+
+		if (!reported || time_before(channel_status->updated, oldest))
+			oldest = channel_status->updated;
+
+		reported = true;
+	}
+
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	if (!reported)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%u\n", jiffies_to_msecs(jiffies - oldest));
+}
+
+static DEVICE_ATTR_RO(status_age_ms);
+
+/*
+ * One line per channel and duty bucket with samples; variances are in
+ * RPM^2 and mA^2. Writing anything clears the statistics.
+ */
+static ssize_t fan_health_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct health_bucket bucket[HEALTH_BUCKETS];
+	unsigned long irq_flags;
+	int channel, i;
+	int len;
+
+	len = sysfs_emit(buf, "# channel duty samples rpm_mean rpm_var "
+			      "curr_mean curr_var\n");
+
+	for (channel = 0; channel < drvdata->config->channel_count; channel++) {
+		read_lock_irqsave(&drvdata->lock, irq_flags);
+		memcpy(bucket, drvdata->health[channel].bucket, sizeof(bucket));
+		read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+		for (i = 0; i < HEALTH_BUCKETS; i++) {
+			if (!bucket[i].rpm.count)
+				continue;
+
+			/* Truncated rather than overflowing the page */
+			if (len + HEALTH_LINE_MAX > PAGE_SIZE)
+				return len;
+
+			len += sysfs_emit_at(
+				buf, len, "%d %d %u %ld %llu %ld %llu\n",
+				channel + 1, i * 10, bucket[i].rpm.count,
+				running_stats_mean(&bucket[i].rpm),
+				running_stats_variance(&bucket[i].rpm),
+				running_stats_mean(&bucket[i].curr),
+				running_stats_variance(&bucket[i].curr));
+		}
+	}
+
+	return len;
+}
+
+static ssize_t fan_health_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned long irq_flags;
+	int channel;
+
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+
+	for (channel = 0; channel < MAX_CHANNELS; channel++)
+		memset(drvdata->health[channel].bucket, 0,
+		       sizeof(drvdata->health[channel].bucket));
+
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(fan_health);
+
+static ssize_t budget_store(struct drvdata *drvdata, const char *buf,
+			    size_t len, unsigned int *budget)
+{
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&drvdata->output_lock);
+	WRITE_ONCE(*budget, val);
+	budget_update(drvdata, 0);
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t curr_budget_ma_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->curr_budget_ma));
+}
+
+static ssize_t curr_budget_ma_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return budget_store(drvdata, buf, len, &drvdata->curr_budget_ma);
+}
+
+static DEVICE_ATTR_RW(curr_budget_ma);
+
+static ssize_t power_budget_mw_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->power_budget_mw));
+}
+
+static ssize_t power_budget_mw_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return budget_store(drvdata, buf, len, &drvdata->power_budget_mw);
+}
+
+static DEVICE_ATTR_RW(power_budget_mw);
+
+static ssize_t firmware_version_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned long irq_flags;
+	bool known;
+	u8 major, patch;
+	u16 minor;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	known = drvdata->decode_status;
+	major = drvdata->firmware_major;
+	minor = drvdata->firmware_minor;
+	patch = drvdata->firmware_patch;
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	if (!known)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%u.%u.%u\n", major, minor, patch);
+}
+
+static DEVICE_ATTR_RO(firmware_version);
+
+static ssize_t settle_timeout_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->settle_timeout_ms));
+}
+
+static ssize_t settle_timeout_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->settle_timeout_ms, val);
+	return len;
+}
+
+static DEVICE_ATTR_RW(settle_timeout_ms);
+
+static ssize_t settle_tolerance_rpm_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->settle_tolerance_rpm));
+}
+
+static ssize_t settle_tolerance_rpm_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->settle_tolerance_rpm, val);
+	return len;
+}
+
+static DEVICE_ATTR_RW(settle_tolerance_rpm);
+
+static ssize_t redetect_interval_ms_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->redetect_interval_ms));
+}
+
+static ssize_t redetect_interval_ms_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->redetect_interval_ms, val);
+
+	if (val)
+		mod_delayed_work(system_wq, &drvdata->redetect_work,
+				 msecs_to_jiffies(val));
+	else
+		cancel_delayed_work(&drvdata->redetect_work);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(redetect_interval_ms);
+
+static ssize_t deadband_show(char *buf, unsigned int *deadband)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(*deadband));
+}
+
+static ssize_t deadband_store(const char *buf, size_t len,
+			      unsigned int *deadband)
+{
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(*deadband, val);
+	return len;
+}
+
+static ssize_t deadband_rpm_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_show(buf, &drvdata->deadband_rpm);
+}
+
+static ssize_t deadband_rpm_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_store(buf, len, &drvdata->deadband_rpm);
+}
+
+static DEVICE_ATTR_RW(deadband_rpm);
+
+static ssize_t deadband_millivolt_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_show(buf, &drvdata->deadband_millivolt);
+}
+
+static ssize_t deadband_millivolt_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_store(buf, len, &drvdata->deadband_millivolt);
+}
+
+static DEVICE_ATTR_RW(deadband_millivolt);
+
+static ssize_t deadband_milliamp_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_show(buf, &drvdata->deadband_milliamp);
+}
+
+static ssize_t deadband_milliamp_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return deadband_store(buf, len, &drvdata->deadband_milliamp);
+}
+
+static DEVICE_ATTR_RW(deadband_milliamp);
+
+static ssize_t heartbeat_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+
+	failsafe_kick(drvdata);
+
+	if (READ_ONCE(drvdata->failsafe_active)) {
+		WRITE_ONCE(drvdata->failsafe_active, false);
+		sysfs_notify(&dev->kobj, NULL, "failsafe_active");
+		genl_notify_failsafe(drvdata, false);
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_WO(heartbeat);
+
+static ssize_t failsafe_timeout_ms_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->failsafe_timeout_ms));
+}
+
+static ssize_t failsafe_timeout_ms_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(drvdata->failsafe_timeout_ms, val);
+	failsafe_kick(drvdata);
+	return len;
+}
+
+static DEVICE_ATTR_RW(failsafe_timeout_ms);
+
+static ssize_t failsafe_pwm_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%ld\n", READ_ONCE(drvdata->failsafe_pwm));
+}
+
+static ssize_t failsafe_pwm_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	long val;
+	int ret = kstrtol(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	WRITE_ONCE(drvdata->failsafe_pwm, val);
+	return len;
+}
+
+static DEVICE_ATTR_RW(failsafe_pwm);
+
+static ssize_t failsafe_active_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(drvdata->failsafe_active));
+}
+
+static DEVICE_ATTR_RO(failsafe_active);
+
+static ssize_t failsafe_count_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->failsafe_count));
+}
+
+static DEVICE_ATTR_RO(failsafe_count);
+
+static ssize_t output_interval_ms_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->output_interval_ms));
+}
+
+static ssize_t output_interval_ms_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	if (val > OUTPUT_MAX_INTERVAL_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(drvdata->output_interval_ms, val);
+	return len;
+}
+
+static DEVICE_ATTR_RW(output_interval_ms);
+
+static ssize_t output_queue_depth_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->output_queue_depth));
+}
+
+static DEVICE_ATTR_RO(output_queue_depth);
+
+static ssize_t output_retries_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->output_retries));
+}
+
+static DEVICE_ATTR_RO(output_retries);
+
+static ssize_t output_failures_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->output_failures));
+}
+
+static DEVICE_ATTR_RO(output_failures);
+
+static struct attribute *extra_attrs[] = { &dev_attr_detect_fans.attr,
+					   &dev_attr_fans_ready.attr,
+					   &dev_attr_ready_timeout_ms.attr,
+					   &dev_attr_redetect_interval_ms.attr,
+					   &dev_attr_firmware_version.attr,
+					   &dev_attr_fan_health.attr,
+					   &dev_attr_idle_timeout_ms.attr,
+					   &dev_attr_status_age_ms.attr,
+					   &dev_attr_curr_budget_ma.attr,
+					   &dev_attr_power_budget_mw.attr,
+					   &dev_attr_deadband_rpm.attr,
+					   &dev_attr_deadband_millivolt.attr,
+					   &dev_attr_deadband_milliamp.attr,
+					   &dev_attr_settle_timeout_ms.attr,
+					   &dev_attr_settle_tolerance_rpm.attr,
+					   &dev_attr_heartbeat.attr,
+					   &dev_attr_failsafe_timeout_ms.attr,
+					   &dev_attr_failsafe_pwm.attr,
+					   &dev_attr_failsafe_active.attr,
+					   &dev_attr_failsafe_count.attr,
+					   &dev_attr_output_interval_ms.attr,
+					   &dev_attr_output_queue_depth.attr,
+					   &dev_attr_output_retries.attr,
+					   &dev_attr_output_failures.attr,
+					   NULL };
+
+static const struct attribute_group extra_group = {
+	.attrs = extra_attrs,
+};
+
+static ssize_t pwm_slew_rate_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->control[channel].slew_rate));
+}
+
+static ssize_t pwm_slew_rate_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].slew_rate = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t pwm_spinup_pwm_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%ld\n",
+			  READ_ONCE(drvdata->control[channel].spinup_pwm));
+}
+
+static ssize_t pwm_spinup_pwm_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	long val;
+	int ret = kstrtol(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].spinup_pwm = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t pwm_spinup_ms_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->control[channel].spinup_ms));
+}
+
+static ssize_t pwm_spinup_ms_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].spinup_ms = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t pwm_group_scale_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->control[channel].group_scale));
+}
+
+static ssize_t pwm_group_scale_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	if (val > 1000)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].group_scale = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t pwm_group_offset_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%ld\n",
+			  READ_ONCE(drvdata->control[channel].group_offset));
+}
+
+static ssize_t pwm_group_offset_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	long val;
+	int ret = kstrtol(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	if (val < -255 || val > 255)
+		return -EINVAL;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].group_offset = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t pwm_budget_priority_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%d\n",
+			  READ_ONCE(drvdata->control[channel].budget_priority));
+}
+
+static ssize_t pwm_budget_priority_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	int val;
+	int ret = kstrtoint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->control[channel].budget_priority = val;
+	budget_update(drvdata, 0);
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+/* The duty the channel is held to by the budget */
+static ssize_t pwm_budget_limit_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%ld\n",
+			  READ_ONCE(drvdata->control[channel].budget_limit));
+}
+
+static ssize_t pwm_calibrate_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct channel_calibration *calibration =
+		&drvdata->calibration[to_sensor_dev_attr(attr)->index];
+	const char *state;
+
+	mutex_lock(&drvdata->output_lock);
+
+	if (calibration->running)
+		state = "running";
+	else if (calibration->curve_size == CALIBRATION_STEPS)
+		state = "done";
+	else
+		state = "idle";
+
+	mutex_unlock(&drvdata->output_lock);
+
+	return sysfs_emit(buf, "%s\n", state);
+}
+
+/* Write 1 to start a calibration sweep, 0 to abort it */
+static ssize_t pwm_calibrate_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	bool val;
+	int ret = kstrtobool(buf, &val);
+
+	if (ret)
+		return ret;
+
+	if (val) {
+		ret = calibration_start(drvdata, channel);
+		return ret ? ret : len;
+	}
+
+	mutex_lock(&drvdata->output_lock);
+	if (drvdata->calibration[channel].running)
+		calibration_stop(drvdata, channel);
+	mutex_unlock(&drvdata->output_lock);
+
+	return len;
+}
+
+/* One "<pwm> <rpm> <mA>" line per point */
+static ssize_t pwm_calibration_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct channel_calibration *calibration =
+		&drvdata->calibration[to_sensor_dev_attr(attr)->index];
+	int len = 0;
+	int i;
+
+	mutex_lock(&drvdata->output_lock);
+
+	for (i = 0; i < calibration->curve_size; i++)
+		len += sysfs_emit_at(buf, len, "%ld %ld %ld\n",
+				     calibration->curve[i].pwm,
+				     calibration->curve[i].speed_rpm,
+				     calibration->curve[i].curr_milliamp);
+
+	mutex_unlock(&drvdata->output_lock);
+
+	return len;
+}
+
+/* Reloads a curve saved from pwm_calibration_show() */
+static ssize_t pwm_calibration_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	struct channel_calibration *calibration =
+		&drvdata->calibration[to_sensor_dev_attr(attr)->index];
+	struct calibration_point curve[CALIBRATION_STEPS];
+	char *copy, *cursor, *line;
+	int curve_size = 0;
+	int ret = 0;
+
+	copy = kstrdup(buf, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cursor = copy;
+
+	while ((line = strsep(&cursor, "\n"))) {
+		struct calibration_point *point = &curve[curve_size];
+
+		if (!*line)
+			continue;
+
+		if (curve_size == CALIBRATION_STEPS ||
+		    sscanf(line, "%ld %ld %ld", &point->pwm, &point->speed_rpm,
+			   &point->curr_milliamp) != 3 ||
+		    point->pwm < 0 || point->pwm > 255 ||
+		    (curve_size && point->pwm <= curve[curve_size - 1].pwm)) {
+			ret = -EINVAL;
+			break;
+		}
+
+		curve_size++;
+	}
+
+	kfree(copy);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&drvdata->output_lock);
+
+	if (calibration->running) {
+		ret = -EBUSY;
+	} else {
+		memcpy(calibration->curve, curve, sizeof(curve));
+		calibration->curve_size = curve_size;
+	}
+
+	mutex_unlock(&drvdata->output_lock);
+
+	return ret ? ret : len;
+}
+
+static bool settle_done(struct drvdata *drvdata, int channel)
+{
+	unsigned long irq_flags;
+	bool done;
+
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	done = drvdata->settle[channel].done || drvdata->removing;
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+
+	return done;
+}
+
+/*
+ * Waits for the duty last written to pwmN_settle to take effect, up to
+ * settle_timeout_ms after the write. Returns how long it took, in ms.
+ */
+static ssize_t pwm_settle_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
 {
-	struct init_command_report *report =
-		kmalloc(sizeof(struct init_command_report), GFP_KERNEL);
-	int ret;
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int timeout_ms = READ_ONCE(drvdata->settle_timeout_ms);
+	struct channel_settle settle;
+	unsigned long irq_flags;
+	bool removing = false;
+	s64 remaining_ms;
+	long ret;
 
-	if (!report)
-		return -ENOMEM;
+	stream_touch(drvdata);
 
-	report->report_id = OUTPUT_REPORT_ID_INIT_COMMAND;
-	report->command = command;
+	read_lock_irqsave(&drvdata->lock, irq_flags);
+	settle = drvdata->settle[channel];
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
 
-	ret = hid_hw_output_report(drvdata->hid, (void *)report,
-				   sizeof(*report));
-	if (ret < 0)
-		pr_warn("Failed to send init command: %d\n", ret);
+	if (!settle.armed)
+		return -ENODATA;
 
-	kfree(report);
-	return 0;
-}
+	remaining_ms = timeout_ms -
+		       ktime_ms_delta(ktime_get(), settle.requested);
+	if (!settle.done && remaining_ms > 0) {
+		atomic_inc(&drvdata->stream_waiters);
+		ret = wait_event_interruptible_timeout(
+			drvdata->settle_wait, settle_done(drvdata, channel),
+			msecs_to_jiffies(remaining_ms));
+		atomic_dec(&drvdata->stream_waiters);
+		if (ret < 0)
+			return ret;
 
-static umode_t hwmon_is_visible(const void *data, enum hwmon_sensor_types type,
-				u32 attr, int channel)
-{
-	if (type == hwmon_pwm && attr == hwmon_pwm_input)
-		return S_IWUSR;
+		read_lock_irqsave(&drvdata->lock, irq_flags);
+		settle = drvdata->settle[channel];
+		removing = drvdata->removing;
+		read_unlock_irqrestore(&drvdata->lock, irq_flags);
+	}
 
-	return S_IRUGO;
-}
+	if (removing)
+		return -ENODEV;
 
-static int hwmon_read_fan(struct channel_status *channel_status, u32 attr,
-			  long *val)
-{
-	switch (attr) {
-	case hwmon_fan_enable:
-		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
-		return 0;
+	if (!settle.done)
+		return -ETIMEDOUT;
 
-	case hwmon_fan_input:
-		*val = channel_status->speed_rpm;
-		return 0;
+	if (settle.error)
+		return settle.error;
 
-	default:
-		return -EINVAL;
-	}
+	return sysfs_emit(buf, "%lld\n",
+			  ktime_ms_delta(settle.settled, settle.requested));
 }
 
-static int hwmon_read_pwm(struct channel_status *channel_status, u32 attr,
-			  long *val)
+/* Sets the duty like pwmN, and arms pwm_settle_show() for it */
+static ssize_t pwm_settle_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
 {
-	switch (attr) {
-	case hwmon_pwm_enable:
-		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
-		return 0;
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned long irq_flags;
+	bool pending = false;
+	long val;
+	int ret = kstrtol(buf, 0, &val);
+	int i;
 
-	case hwmon_pwm_mode:
-		*val = (channel_status->fan_type == FAN_TYPE_PWM) ? 1 : 0;
-		return 0;
+	if (ret)
+		return ret;
 
-	default:
+	if (val < 0 || val > 255)
 		return -EINVAL;
-	}
-}
 
-static int hwmon_read_in(struct channel_status *channel_status, u32 attr,
-			 long *val)
-{
-	switch (attr) {
-	case hwmon_in_enable:
-		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
-		return 0;
+	/* Confirmation needs reports */
+	stream_touch(drvdata);
 
-	case hwmon_in_input:
-		*val = channel_status->in_millivolt;
-		return 0;
+	mutex_lock(&drvdata->output_lock);
 
-	default:
-		return -EINVAL;
-	}
-}
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	drvdata->settle[channel] = (struct channel_settle){
+		.armed = true,
+		.pwm = val,
+		.requested = ktime_get(),
+	};
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
 
-static int hwmon_read_curr(struct channel_status *channel_status, u32 attr,
-			   long *val)
-{
-	switch (attr) {
-	case hwmon_curr_enable:
-		*val = (channel_status->fan_type == FAN_TYPE_NONE) ? 0 : 1;
-		return 0;
+	set_pwm(drvdata, channel, val, OUTPUT_PRIORITY_NORMAL);
 
-	case hwmon_curr_input:
-		*val = channel_status->curr_milliamp;
-		return 0;
+	/* Nothing to send if the device already runs at this duty */
+	for (i = 0; i < OUTPUT_PRIORITY_COUNT; i++)
+		pending |= test_bit(channel, &drvdata->pending_speed[i]);
 
-	default:
-		return -EINVAL;
-	}
+	if (!pending)
+		speed_sent(drvdata, channel, 0);
+
+	mutex_unlock(&drvdata->output_lock);
+
+	return len;
 }
 
-static int hwmon_read(struct device *dev, enum hwmon_sensor_types type,
-		      u32 attr, int channel, long *val)
+static ssize_t fan_average_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
 	struct drvdata *drvdata = dev_get_drvdata(dev);
-	struct channel_status *channel_status =
-		get_channel_status(drvdata, channel);
+	int channel = to_sensor_dev_attr(attr)->index;
 	unsigned long irq_flags;
-	int ret;
+	bool fan;
+	long val;
 
-	if (!channel_status)
-		return -EINVAL;
+	stream_touch(drvdata);
 
 	read_lock_irqsave(&drvdata->lock, irq_flags);
+	fan = drvdata->channel[channel].fan_type != FAN_TYPE_NONE;
+	val = channel_average(&drvdata->filter[channel],
+			      &drvdata->channel[channel], FILTER_METRIC_RPM);
+	read_unlock_irqrestore(&drvdata->lock, irq_flags);
 
-	switch (type) {
-	case hwmon_fan:
-		ret = hwmon_read_fan(channel_status, attr, val);
-		break;
-
-	case hwmon_pwm:
-		ret = hwmon_read_pwm(channel_status, attr, val);
-		break;
+	/* Like the hwmon readings, see hwmon_read() */
+	if (!fan)
+		return -ENODATA;
 
-	case hwmon_in:
-		ret = hwmon_read_in(channel_status, attr, val);
-		break;
+	return sysfs_emit(buf, "%ld\n", val);
+}
 
-	case hwmon_curr:
-		ret = hwmon_read_curr(channel_status, attr, val);
-		break;
+static ssize_t fan_filter_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	enum filter_type type = READ_ONCE(drvdata->filter[channel].type);
 
-	default:
-		ret = -EINVAL;
-	}
+	return sysfs_emit(buf, "%s\n", filter_names[type]);
+}
 
-	read_unlock_irqrestore(&drvdata->lock, irq_flags);
+static void set_filter(struct drvdata *drvdata, int channel,
+		       enum filter_type type, unsigned int tau_ms,
+		       unsigned int window)
+{
+	struct channel_filter *filter = &drvdata->filter[channel];
+	unsigned long irq_flags;
 
-	return ret;
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	filter->type = type;
+	filter->tau_ms = tau_ms;
+	filter->window = window;
+	filter->sample_count = 0;
+	filter->next_sample = 0;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
 }
 
-static int hwmon_write_pwm_input(struct drvdata *drvdata, int channel, long val)
+static ssize_t fan_filter_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
 {
-	struct set_fan_speed_report *report =
-		kzalloc(sizeof(struct set_fan_speed_report), GFP_KERNEL);
-	int ret;
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct channel_filter *filter = &drvdata->filter[channel];
+	int type = sysfs_match_string(filter_names, buf);
 
-	if (!report)
-		return -ENOMEM;
+	if (type < 0)
+		return type;
 
-	report->report_id = OUTPUT_REPORT_ID_CHANNEL_COMMAND;
-	report->command = CHANNEL_COMMAND_ID_SET_FAN_SPEED;
-	report->channel_index = channel;
+	set_filter(drvdata, channel, type, READ_ONCE(filter->tau_ms),
+		   READ_ONCE(filter->window));
+	return len;
+}
 
-	if (val >= 255)
-		report->fan_speed_percent = 100;
-	else if (val <= 0)
-		report->fan_speed_percent = 0;
-	else
-		report->fan_speed_percent = val * 100 / 255;
+static ssize_t fan_filter_tau_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
 
-	ret = hid_hw_output_report(drvdata->hid, (void *)report,
-				   sizeof(*report));
-	kfree(report);
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->filter[channel].tau_ms));
+}
 
-	return ret;
+static ssize_t fan_filter_tau_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct channel_filter *filter = &drvdata->filter[channel];
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	set_filter(drvdata, channel, READ_ONCE(filter->type), val,
+		   READ_ONCE(filter->window));
+	return len;
 }
 
-static int hwmon_write_pwm(struct drvdata *drvdata, u32 attr, int channel,
-			   long val)
+static ssize_t fan_filter_window_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	switch (attr) {
-	case hwmon_pwm_input:
-		return hwmon_write_pwm_input(drvdata, channel, val);
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
 
-	default:
-		return -EINVAL;
-	}
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(drvdata->filter[channel].window));
 }
 
-static int hwmon_write(struct device *dev, enum hwmon_sensor_types type,
-		       u32 attr, int channel, long val)
+static ssize_t fan_filter_window_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
 {
 	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct channel_filter *filter = &drvdata->filter[channel];
+	unsigned int val;
+	int ret = kstrtouint(buf, 0, &val);
 
-	switch (type) {
-	case hwmon_pwm:
-		return hwmon_write_pwm(drvdata, attr, channel, val);
+	if (ret)
+		return ret;
 
-	default:
+	if (val < 1 || val > FILTER_MEDIAN_MAX)
 		return -EINVAL;
-	}
+
+	set_filter(drvdata, channel, READ_ONCE(filter->type),
+		   READ_ONCE(filter->tau_ms), val);
+	return len;
 }
 
-static const struct hwmon_ops hwmon_ops = {
-	.is_visible = hwmon_is_visible,
-	.read = hwmon_read,
-	.write = hwmon_write,
-};
+static SENSOR_DEVICE_ATTR_RO(fan1_average, fan_average, 0);
+static SENSOR_DEVICE_ATTR_RO(fan2_average, fan_average, 1);
+static SENSOR_DEVICE_ATTR_RO(fan3_average, fan_average, 2);
+static SENSOR_DEVICE_ATTR_RO(fan4_average, fan_average, 3);
+static SENSOR_DEVICE_ATTR_RO(fan5_average, fan_average, 4);
+static SENSOR_DEVICE_ATTR_RO(fan6_average, fan_average, 5);
 
-#define FAN_CHANNEL (HWMON_F_INPUT | HWMON_F_ENABLE)
-#define PWM_CHANNEL (HWMON_PWM_MODE | HWMON_PWM_INPUT | HWMON_PWM_ENABLE)
-#define IN_CHANNEL (HWMON_I_INPUT | HWMON_I_ENABLE)
-#define CURR_CHANNEL (HWMON_C_INPUT | HWMON_C_ENABLE)
-
-static const struct hwmon_channel_info *grid_v3_channel_info[] = {
-	HWMON_CHANNEL_INFO(fan, FAN_CHANNEL, FAN_CHANNEL, FAN_CHANNEL,
-			   FAN_CHANNEL, FAN_CHANNEL, FAN_CHANNEL),
-	HWMON_CHANNEL_INFO(pwm, PWM_CHANNEL, PWM_CHANNEL, PWM_CHANNEL,
-			   PWM_CHANNEL, PWM_CHANNEL, PWM_CHANNEL),
-	HWMON_CHANNEL_INFO(in, IN_CHANNEL, IN_CHANNEL, IN_CHANNEL, IN_CHANNEL,
-			   IN_CHANNEL, IN_CHANNEL),
-	HWMON_CHANNEL_INFO(curr, CURR_CHANNEL, CURR_CHANNEL, CURR_CHANNEL,
-			   CURR_CHANNEL, CURR_CHANNEL, CURR_CHANNEL),
-	NULL
-};
+static SENSOR_DEVICE_ATTR_RW(fan1_filter, fan_filter, 0);
+static SENSOR_DEVICE_ATTR_RW(fan2_filter, fan_filter, 1);
+static SENSOR_DEVICE_ATTR_RW(fan3_filter, fan_filter, 2);
+static SENSOR_DEVICE_ATTR_RW(fan4_filter, fan_filter, 3);
+static SENSOR_DEVICE_ATTR_RW(fan5_filter, fan_filter, 4);
+static SENSOR_DEVICE_ATTR_RW(fan6_filter, fan_filter, 5);
 
-static const struct hwmon_chip_info grid_v3_chip_info = {
-	.ops = &hwmon_ops,
-	.info = grid_v3_channel_info,
-};
+static SENSOR_DEVICE_ATTR_RW(fan1_filter_tau_ms, fan_filter_tau_ms, 0);
+static SENSOR_DEVICE_ATTR_RW(fan2_filter_tau_ms, fan_filter_tau_ms, 1);
+static SENSOR_DEVICE_ATTR_RW(fan3_filter_tau_ms, fan_filter_tau_ms, 2);
+static SENSOR_DEVICE_ATTR_RW(fan4_filter_tau_ms, fan_filter_tau_ms, 3);
+static SENSOR_DEVICE_ATTR_RW(fan5_filter_tau_ms, fan_filter_tau_ms, 4);
+static SENSOR_DEVICE_ATTR_RW(fan6_filter_tau_ms, fan_filter_tau_ms, 5);
 
-static const struct hwmon_channel_info *smart_device_v1_channel_info[] = {
-	HWMON_CHANNEL_INFO(fan, FAN_CHANNEL, FAN_CHANNEL, FAN_CHANNEL),
-	HWMON_CHANNEL_INFO(pwm, PWM_CHANNEL, PWM_CHANNEL, PWM_CHANNEL),
-	HWMON_CHANNEL_INFO(in, IN_CHANNEL, IN_CHANNEL, IN_CHANNEL),
-	HWMON_CHANNEL_INFO(curr, CURR_CHANNEL, CURR_CHANNEL, CURR_CHANNEL), NULL
-};
+static SENSOR_DEVICE_ATTR_RW(fan1_filter_window, fan_filter_window, 0);
+static SENSOR_DEVICE_ATTR_RW(fan2_filter_window, fan_filter_window, 1);
+static SENSOR_DEVICE_ATTR_RW(fan3_filter_window, fan_filter_window, 2);
+static SENSOR_DEVICE_ATTR_RW(fan4_filter_window, fan_filter_window, 3);
+static SENSOR_DEVICE_ATTR_RW(fan5_filter_window, fan_filter_window, 4);
+static SENSOR_DEVICE_ATTR_RW(fan6_filter_window, fan_filter_window, 5);
 
-static const struct hwmon_chip_info smart_device_v1_chip_info = {
-	.ops = &hwmon_ops,
-	.info = smart_device_v1_channel_info,
-};
+static SENSOR_DEVICE_ATTR_RW(pwm1_slew_rate, pwm_slew_rate, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_slew_rate, pwm_slew_rate, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_slew_rate, pwm_slew_rate, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_slew_rate, pwm_slew_rate, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_slew_rate, pwm_slew_rate, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_slew_rate, pwm_slew_rate, 5);
 
-enum {
-	DEVICE_CONFIG_GRID_V3,
-	DEVICE_CONFIG_SMART_DEVICE_V1,
-	DEVICE_CONFIG_COUNT
-};
+static SENSOR_DEVICE_ATTR_RW(pwm1_spinup_pwm, pwm_spinup_pwm, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_spinup_pwm, pwm_spinup_pwm, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_spinup_pwm, pwm_spinup_pwm, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_spinup_pwm, pwm_spinup_pwm, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_spinup_pwm, pwm_spinup_pwm, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_spinup_pwm, pwm_spinup_pwm, 5);
 
-static const struct hwmon_chip_info *device_configs[DEVICE_CONFIG_COUNT] = {
-	[DEVICE_CONFIG_GRID_V3] = &grid_v3_chip_info,
-	[DEVICE_CONFIG_SMART_DEVICE_V1] = &smart_device_v1_chip_info,
-};
+static SENSOR_DEVICE_ATTR_RW(pwm1_spinup_ms, pwm_spinup_ms, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_spinup_ms, pwm_spinup_ms, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_spinup_ms, pwm_spinup_ms, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_spinup_ms, pwm_spinup_ms, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_spinup_ms, pwm_spinup_ms, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_spinup_ms, pwm_spinup_ms, 5);
 
-static const struct hid_device_id hid_id_table[] = {
-	{ HID_USB_DEVICE(USB_VENDOR_ID_NZXT, USB_PRODUCT_ID_NZXT_GRID_V3),
-	  .driver_data = DEVICE_CONFIG_GRID_V3 },
-	{ HID_USB_DEVICE(USB_VENDOR_ID_NZXT,
-			 USB_PRODUCT_ID_NZXT_SMART_DEVICE_V1),
-	  .driver_data = DEVICE_CONFIG_SMART_DEVICE_V1 },
-	{}
+static SENSOR_DEVICE_ATTR_RW(pwm1_group_scale, pwm_group_scale, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_group_scale, pwm_group_scale, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_group_scale, pwm_group_scale, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_group_scale, pwm_group_scale, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_group_scale, pwm_group_scale, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_group_scale, pwm_group_scale, 5);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_group_offset, pwm_group_offset, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_group_offset, pwm_group_offset, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_group_offset, pwm_group_offset, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_group_offset, pwm_group_offset, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_group_offset, pwm_group_offset, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_group_offset, pwm_group_offset, 5);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_budget_priority, pwm_budget_priority, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_budget_priority, pwm_budget_priority, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_budget_priority, pwm_budget_priority, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_budget_priority, pwm_budget_priority, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_budget_priority, pwm_budget_priority, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_budget_priority, pwm_budget_priority, 5);
+
+static SENSOR_DEVICE_ATTR_RO(pwm1_budget_limit, pwm_budget_limit, 0);
+static SENSOR_DEVICE_ATTR_RO(pwm2_budget_limit, pwm_budget_limit, 1);
+static SENSOR_DEVICE_ATTR_RO(pwm3_budget_limit, pwm_budget_limit, 2);
+static SENSOR_DEVICE_ATTR_RO(pwm4_budget_limit, pwm_budget_limit, 3);
+static SENSOR_DEVICE_ATTR_RO(pwm5_budget_limit, pwm_budget_limit, 4);
+static SENSOR_DEVICE_ATTR_RO(pwm6_budget_limit, pwm_budget_limit, 5);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_calibrate, pwm_calibrate, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_calibrate, pwm_calibrate, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_calibrate, pwm_calibrate, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_calibrate, pwm_calibrate, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_calibrate, pwm_calibrate, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_calibrate, pwm_calibrate, 5);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_settle, pwm_settle, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_settle, pwm_settle, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_settle, pwm_settle, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_settle, pwm_settle, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_settle, pwm_settle, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_settle, pwm_settle, 5);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_calibration, pwm_calibration, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_calibration, pwm_calibration, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_calibration, pwm_calibration, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_calibration, pwm_calibration, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_calibration, pwm_calibration, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_calibration, pwm_calibration, 5);
+
+static struct attribute *channel_attrs[] = {
+	&sensor_dev_attr_pwm1_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm2_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm3_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm4_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm5_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm6_slew_rate.dev_attr.attr,
+	&sensor_dev_attr_pwm1_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm2_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm3_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm4_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm5_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm6_spinup_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm1_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm2_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm3_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm4_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm5_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm6_spinup_ms.dev_attr.attr,
+	&sensor_dev_attr_pwm1_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm2_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm3_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm4_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm5_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm6_group_scale.dev_attr.attr,
+	&sensor_dev_attr_pwm1_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm2_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm3_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm4_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm5_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm6_group_offset.dev_attr.attr,
+	&sensor_dev_attr_pwm1_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm2_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm3_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm4_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm5_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm6_budget_priority.dev_attr.attr,
+	&sensor_dev_attr_pwm1_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm2_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm3_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm4_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm5_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm6_budget_limit.dev_attr.attr,
+	&sensor_dev_attr_pwm1_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm2_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm3_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm4_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm5_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm6_calibrate.dev_attr.attr,
+	&sensor_dev_attr_pwm1_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm2_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm3_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm4_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm5_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm6_settle.dev_attr.attr,
+	&sensor_dev_attr_pwm1_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm2_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm3_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm4_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm5_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm6_calibration.dev_attr.attr,
+	&sensor_dev_attr_fan1_average.dev_attr.attr,
+	&sensor_dev_attr_fan2_average.dev_attr.attr,
+	&sensor_dev_attr_fan3_average.dev_attr.attr,
+	&sensor_dev_attr_fan4_average.dev_attr.attr,
+	&sensor_dev_attr_fan5_average.dev_attr.attr,
+	&sensor_dev_attr_fan6_average.dev_attr.attr,
+	&sensor_dev_attr_fan1_filter.dev_attr.attr,
+	&sensor_dev_attr_fan2_filter.dev_attr.attr,
+	&sensor_dev_attr_fan3_filter.dev_attr.attr,
+	&sensor_dev_attr_fan4_filter.dev_attr.attr,
+	&sensor_dev_attr_fan5_filter.dev_attr.attr,
+	&sensor_dev_attr_fan6_filter.dev_attr.attr,
+	&sensor_dev_attr_fan1_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan2_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan3_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan4_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan5_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan6_filter_tau_ms.dev_attr.attr,
+	&sensor_dev_attr_fan1_filter_window.dev_attr.attr,
+	&sensor_dev_attr_fan2_filter_window.dev_attr.attr,
+	&sensor_dev_attr_fan3_filter_window.dev_attr.attr,
+	&sensor_dev_attr_fan4_filter_window.dev_attr.attr,
+	&sensor_dev_attr_fan5_filter_window.dev_attr.attr,
+	&sensor_dev_attr_fan6_filter_window.dev_attr.attr,
+	NULL
 };
 
-static int hid_raw_event(struct hid_device *hdev, struct hid_report *report,
-			 u8 *data, int size)
+static umode_t channel_attr_is_visible(struct kobject *kobj,
+				       struct attribute *attr, int index)
 {
-	struct drvdata *drvdata = hid_get_drvdata(hdev);
-	uint8_t report_id = *data;
+	struct drvdata *drvdata = dev_get_drvdata(kobj_to_dev(kobj));
+	struct device_attribute *dev_attr =
+		container_of(attr, struct device_attribute, attr);
 
-	if (report_id != INPUT_REPORT_ID_STATUS) {
-		pr_warn("Unknown input report: type %#x, size %d\n", report_id,
-			size);
-		return 0;
-	}
+	int channel = to_sensor_dev_attr(dev_attr)->index;
 
-	if (size != sizeof(struct status_report)) {
-		pr_warn("Invalid status report size %d\n", size);
+	if (channel >= drvdata->config->channel_count)
 		return 0;
-	}
 
-	update_status(drvdata, (struct status_report *)data);
-	return 0;
+	return attr->mode;
 }
 
-#ifdef CONFIG_PM
+static const struct attribute_group channel_group = {
+	.attrs = channel_attrs,
+	.is_visible = channel_attr_is_visible,
+};
 
-static int hid_reset_resume(struct hid_device *hdev)
+static ssize_t group_channels_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	struct drvdata *drvdata = hid_get_drvdata(hdev);
-	return send_init_command(drvdata, INIT_COMMAND_ID_DETECT_FANS);
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int group = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%#lx\n",
+			  READ_ONCE(drvdata->group[group].channels));
 }
 
-#endif
+/* Bitmask of member channels, bit 0 is pwm1 */
+static ssize_t group_channels_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int group = to_sensor_dev_attr(attr)->index;
+	unsigned long val;
+	int ret = kstrtoul(buf, 0, &val);
 
-static ssize_t detect_fans_store(struct device *dev,
-				 struct device_attribute *attr, const char *buf,
-				 size_t len)
+	if (ret)
+		return ret;
+
+	if (val & ~GENMASK(drvdata->config->channel_count - 1, 0))
+		return -EINVAL;
+
+	mutex_lock(&drvdata->output_lock);
+	drvdata->group[group].channels = val;
+	mutex_unlock(&drvdata->output_lock);
+	return len;
+}
+
+static ssize_t group_pwm_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
 {
 	struct drvdata *drvdata = dev_get_drvdata(dev);
-	int ret = send_init_command(drvdata, INIT_COMMAND_ID_DETECT_FANS);
-	return (ret == 0) ? len : ret;
+	struct pwm_group *pwm_group =
+		&drvdata->group[to_sensor_dev_attr(attr)->index];
+	long pwm;
+	bool pwm_set;
+
+	mutex_lock(&drvdata->output_lock);
+	pwm = pwm_group->pwm;
+	pwm_set = pwm_group->pwm_set;
+	mutex_unlock(&drvdata->output_lock);
+
+	if (!pwm_set)
+		return -ENODATA;
+
+	return sysfs_emit(buf, "%ld\n", pwm);
 }
 
-static DEVICE_ATTR_WO(detect_fans);
+static ssize_t group_pwm_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t len)
+{
+	struct drvdata *drvdata = dev_get_drvdata(dev);
+	int group = to_sensor_dev_attr(attr)->index;
+	long val;
+	int ret = kstrtol(buf, 0, &val);
+
+	if (ret)
+		return ret;
+
+	set_group_pwm(drvdata, group, clamp_val(val, 0, 255));
+	return len;
+}
 
-static struct attribute *extra_attrs[] = { &dev_attr_detect_fans.attr, NULL };
+static SENSOR_DEVICE_ATTR_RW(group1_channels, group_channels, 0);
+static SENSOR_DEVICE_ATTR_RW(group2_channels, group_channels, 1);
+static SENSOR_DEVICE_ATTR_RW(group3_channels, group_channels, 2);
+static SENSOR_DEVICE_ATTR_RW(group4_channels, group_channels, 3);
 
-ATTRIBUTE_GROUPS(extra);
+static SENSOR_DEVICE_ATTR_RW(group1_pwm, group_pwm, 0);
+static SENSOR_DEVICE_ATTR_RW(group2_pwm, group_pwm, 1);
+static SENSOR_DEVICE_ATTR_RW(group3_pwm, group_pwm, 2);
+static SENSOR_DEVICE_ATTR_RW(group4_pwm, group_pwm, 3);
+
+static struct attribute *pwm_group_attrs[] = {
+	&sensor_dev_attr_group1_channels.dev_attr.attr,
+	&sensor_dev_attr_group2_channels.dev_attr.attr,
+	&sensor_dev_attr_group3_channels.dev_attr.attr,
+	&sensor_dev_attr_group4_channels.dev_attr.attr,
+	&sensor_dev_attr_group1_pwm.dev_attr.attr,
+	&sensor_dev_attr_group2_pwm.dev_attr.attr,
+	&sensor_dev_attr_group3_pwm.dev_attr.attr,
+	&sensor_dev_attr_group4_pwm.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group pwm_group_group = {
+	.attrs = pwm_group_attrs,
+};
+
+static const struct attribute_group *extra_groups[] = {
+	&extra_group,
+	&channel_group,
+	&pwm_group_group,
+	NULL
+};
 
 static int hid_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
+	const struct device_config *config = &device_configs[id->driver_data];
 	struct drvdata *drvdata;
 	int ret;
+	int i;
 
 	drvdata = devm_kzalloc(&hdev->dev, sizeof(struct drvdata), GFP_KERNEL);
 	if (!drvdata)
 		return -ENOMEM;
 
+	drvdata->output_report = devm_kzalloc(
+		&hdev->dev, sizeof(union output_report), GFP_KERNEL);
+	if (!drvdata->output_report)
+		return -ENOMEM;
+
+	if (WARN_ON(config->channel_count > MAX_CHANNELS))
+		return -EINVAL;
+
+	drvdata->config = config;
+
 	rwlock_init(&drvdata->lock);
+	init_completion(&drvdata->fans_detected);
+	mutex_init(&drvdata->output_lock);
+	INIT_DELAYED_WORK(&drvdata->output_work, output_work);
+	init_waitqueue_head(&drvdata->output_wait);
+	INIT_WORK(&drvdata->detect_fans_work, detect_fans_work);
+	INIT_DELAYED_WORK(&drvdata->redetect_work, redetect_work);
+	INIT_WORK(&drvdata->fan_event_work, fan_event_work);
+	INIT_WORK(&drvdata->genl_status_work, genl_status_work);
+	INIT_DELAYED_WORK(&drvdata->failsafe_work, failsafe_work);
+	INIT_DELAYED_WORK(&drvdata->ramp_work, ramp_work);
+	INIT_WORK(&drvdata->budget_work, budget_work);
+	INIT_DELAYED_WORK(&drvdata->calibration_work, calibration_work);
+	mutex_init(&drvdata->stream_lock);
+	INIT_DELAYED_WORK(&drvdata->idle_work, idle_work);
+	init_waitqueue_head(&drvdata->settle_wait);
+	drvdata->settle_timeout_ms = 5000;
+	drvdata->failsafe_pwm = 255;
+
+	for (i = 0; i < MAX_CHANNELS; i++) {
+		drvdata->control[i].group_scale = 100;
+		drvdata->control[i].budget_limit = 255;
+		drvdata->filter[i].tau_ms = 1000;
+		drvdata->filter[i].window = 5;
+	}
+
+	drvdata->capture = kzalloc(sizeof(struct capture), GFP_KERNEL);
+	if (!drvdata->capture)
+		return -ENOMEM;
+
+	kref_init(&drvdata->capture->kref);
+	spin_lock_init(&drvdata->capture->lock);
+	mutex_init(&drvdata->capture->read_lock);
+	init_waitqueue_head(&drvdata->capture->wait);
+
+	/* Open capture files keep their own reference */
+	ret = devm_add_action_or_reset(&hdev->dev, capture_put,
+				       drvdata->capture);
+	if (ret)
+		return ret;
 
 	drvdata->hid = hdev;
 	hid_set_drvdata(hdev, drvdata);
@@ -460,25 +4697,34 @@ static int hid_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	if (ret)
 		goto out_hw_stop;
 
-	hid_device_io_start(hdev);
+	drvdata->stream_open = true;
+	drvdata->stream_access = jiffies;
 
-	ret = send_init_command(drvdata, INIT_COMMAND_ID_DETECT_FANS);
-	if (ret)
-		goto out_hw_close;
+	hid_device_io_start(hdev);
 
 	drvdata->hwmon =
 		hwmon_device_register_with_info(&hdev->dev, "nzxtgrid", drvdata,
-						device_configs[id->driver_data],
-						extra_groups);
+						&chip_info, extra_groups);
 	if (IS_ERR(drvdata->hwmon)) {
 		ret = PTR_ERR(drvdata->hwmon);
 		goto out_hw_close;
 	}
 
+	/* Fan detection is a USB round trip, keep it off the probe path */
+	schedule_work(&drvdata->detect_fans_work);
+
+	debugfs_init(drvdata);
+
+	mutex_lock(&devices_lock);
+	list_add_tail(&drvdata->node, &devices);
+	mutex_unlock(&devices_lock);
+
 	return 0;
 
 out_hw_close:
 	hid_hw_close(hdev);
+	cancel_work_sync(&drvdata->fan_event_work);
+	cancel_work_sync(&drvdata->genl_status_work);
 out_hw_stop:
 	hid_hw_stop(hdev);
 	return ret;
@@ -487,8 +4733,48 @@ static int hid_probe(struct hid_device *hdev, const struct hid_device_id *id)
 static void hid_remove(struct hid_device *hdev)
 {
 	struct drvdata *drvdata = hid_get_drvdata(hdev);
+	unsigned long irq_flags;
+
+	mutex_lock(&devices_lock);
+	list_del(&drvdata->node);
+	mutex_unlock(&devices_lock);
+
+	/*
+	 * Removing debugfs and unregistering hwmon wait for file operations
+	 * and sysfs callbacks to return. Don't let the ones blocked on
+	 * readiness, set-and-confirm or capture sit out their timeouts, or
+	 * wait forever for reports that won't come.
+	 */
+	write_lock_irqsave(&drvdata->lock, irq_flags);
+	drvdata->removing = true;
+	write_unlock_irqrestore(&drvdata->lock, irq_flags);
+	complete_all(&drvdata->fans_detected);
+	wake_up_all(&drvdata->settle_wait);
+	capture_remove(drvdata->capture);
+
+	debugfs_remove_recursive(drvdata->debugfs);
+
+	/*
+	 * Work items notify through the hwmon device, keep it around until
+	 * they're done. Unregistering it first stops sysfs from rearming them,
+	 * closing the device stops input reports from doing the same.
+	 */
+	get_device(drvdata->hwmon);
 	hwmon_device_unregister(drvdata->hwmon);
-	hid_hw_close(hdev);
+	stream_close(drvdata);
+	cancel_work_sync(&drvdata->detect_fans_work);
+	cancel_delayed_work_sync(&drvdata->redetect_work);
+	cancel_work_sync(&drvdata->fan_event_work);
+	cancel_work_sync(&drvdata->genl_status_work);
+	cancel_delayed_work_sync(&drvdata->failsafe_work);
+	cancel_delayed_work_sync(&drvdata->calibration_work);
+	cancel_delayed_work_sync(&drvdata->idle_work);
+	cancel_work_sync(&drvdata->budget_work);
+	/* Last, everything above can schedule them */
+	cancel_delayed_work_sync(&drvdata->ramp_work);
+	cancel_delayed_work_sync(&drvdata->output_work);
+	put_device(drvdata->hwmon);
+
 	hid_hw_stop(hdev);
 }
 
@@ -499,18 +4785,50 @@ static struct hid_driver driver = {
 	.remove = hid_remove,
 	.raw_event = hid_raw_event,
 #ifdef CONFIG_PM
+	.resume = hid_resume,
 	.reset_resume = hid_reset_resume,
 #endif
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 
 static int __init nzxtgrid_init(void)
 {
-	return hid_register_driver(&driver);
+	int ret;
+
+	debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	/* Before any device can publish on it */
+	ret = genl_register_family(&genl_family);
+	if (ret)
+		goto out_debugfs;
+
+	ret = hid_register_driver(&driver);
+	if (ret)
+		goto out_genl;
+
+	ret = misc_register(&aggregate_miscdev);
+	if (ret)
+		goto out_unregister;
+
+	return 0;
+
+out_unregister:
+	hid_unregister_driver(&driver);
+out_genl:
+	genl_unregister_family(&genl_family);
+out_debugfs:
+	debugfs_remove_recursive(debugfs_root);
+	return ret;
 }
 
 static void __exit nzxtgrid_exit(void)
 {
+	misc_deregister(&aggregate_miscdev);
 	hid_unregister_driver(&driver);
+	genl_unregister_family(&genl_family);
+	debugfs_remove_recursive(debugfs_root);
 }
 
 MODULE_DEVICE_TABLE(hid, hid_id_table);